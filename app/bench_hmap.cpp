@@ -0,0 +1,110 @@
+// Times the HMap operations the keyspace does: insert, lookup of present
+// and absent keys, and pop. The engine is picked at build time, so build it
+// once as is (chained) and once with -DHMAP_SWISS (open addressing) and
+// compare the two outputs.
+//
+// usage: bench_hmap [nkeys] [rounds]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "hashtable.h"
+
+struct Item
+{
+    HNode node;
+    std::string key;
+};
+
+static bool item_eq(HNode *lhs, HNode *rhs)
+{
+    return container_of(lhs, Item, node)->key == container_of(rhs, Item, node)->key;
+}
+
+static void make_key(Item *item, const char *prefix, size_t i)
+{
+    item->key = prefix + std::to_string(i);
+    item->node.hcode = str_hash((const uint8_t *)item->key.data(), item->key.size());
+}
+
+static void report(const char *name, uint64_t start, size_t nops)
+{
+    double ns = (double)(get_monotonic_nsec() - start) / (double)nops;
+    printf("%-8s %8.1f ns/op\n", name, ns);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nkeys = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+    size_t rounds = argc > 2 ? (size_t)atol(argv[2]) : 3;
+
+#ifdef HMAP_SWISS
+    printf("engine: open addressing, %zu keys\n", nkeys);
+#else
+    printf("engine: chained, %zu keys\n", nkeys);
+#endif
+
+    std::vector<Item> items(nkeys), absent(nkeys);
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        make_key(&items[i], "key:", i);
+        make_key(&absent[i], "nokey:", i);
+    }
+    // visit in random order so the lookups do not walk memory in sequence
+    std::vector<size_t> order(nkeys);
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        order[i] = i;
+    }
+    std::mt19937_64 rng(1);
+
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        HMap hmap;
+        std::shuffle(order.begin(), order.end(), rng);
+
+        uint64_t start = get_monotonic_nsec();
+        for (size_t i : order)
+        {
+            hm_insert(&hmap, &items[i].node);
+        }
+        report("insert", start, nkeys);
+
+        std::shuffle(order.begin(), order.end(), rng);
+        size_t found = 0;
+        start = get_monotonic_nsec();
+        for (size_t i : order)
+        {
+            found += hm_lookup(&hmap, &items[i].node, &item_eq) != NULL;
+        }
+        report("hit", start, nkeys);
+
+        start = get_monotonic_nsec();
+        for (size_t i : order)
+        {
+            found += hm_lookup(&hmap, &absent[i].node, &item_eq) != NULL;
+        }
+        report("miss", start, nkeys);
+
+        HMapStats stats;
+        hm_stats(&hmap, &stats);
+        printf("found %zu of %zu, %zu slots\n", found, nkeys, stats.buckets);
+
+        std::shuffle(order.begin(), order.end(), rng);
+        start = get_monotonic_nsec();
+        for (size_t i : order)
+        {
+            hm_pop(&hmap, &items[i].node, &item_eq);
+        }
+        report("pop", start, nkeys);
+
+        printf("left %zu\n\n", hm_size(&hmap));
+        hm_destroy(&hmap);
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Compares the readiness loop (epoll/select) with the io_uring loop by the
+// number of syscalls the server makes per request. The server runs in this
+// process so its counters (io_stats_total()) can be read directly.
+//
+// usage: bench_io [nconn] [rounds] [depth]
+//   nconn  connections, driven round-robin by one client thread
+//   rounds request batches per connection
+//   depth  requests written back-to-back per connection in each batch
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+#include "connection.h"
+
+static void write_all(SOCKET fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        int rv = send(fd, buf, (int)n, 0);
+        if (rv <= 0)
+        {
+            die("send()");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+static void read_full(SOCKET fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        int rv = recv(fd, buf, (int)n, 0);
+        if (rv <= 0)
+        {
+            die("recv()");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+static void append_req(std::string &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + (uint32_t)s.size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t n = (uint32_t)cmd.size();
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t p = (uint32_t)s.size();
+        out.append((char *)&p, 4);
+        out.append(s);
+    }
+}
+
+static SOCKET connect_to(uint16_t port)
+{
+    SOCKET fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == INVALID_SOCKET)
+    {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        die("connect()");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&val, sizeof(val));
+    return fd;
+}
+
+static void run_load(const char *name, uint16_t port, int nconn, int rounds, int depth)
+{
+    std::vector<SOCKET> fds;
+    for (int i = 0; i < nconn; ++i)
+    {
+        fds.push_back(connect_to(port));
+    }
+    // let the server register the connections before measuring
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    IOTotals before = io_stats_total();
+    auto t0 = std::chrono::steady_clock::now();
+    std::string batch;
+    char rbuf[4 + 4096];
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int i = 0; i < nconn; ++i)
+        {
+            batch.clear();
+            for (int d = 0; d < depth; ++d)
+            {
+                std::string key = "k" + std::to_string(i * depth + d);
+                if (r == 0)
+                {
+                    append_req(batch, {"set", key, "v"});
+                }
+                else
+                {
+                    append_req(batch, {"get", key});
+                }
+            }
+            write_all(fds[i], batch.data(), batch.size());
+        }
+        for (int i = 0; i < nconn; ++i)
+        {
+            for (int d = 0; d < depth; ++d)
+            {
+                uint32_t len = 0;
+                read_full(fds[i], rbuf, 4);
+                memcpy(&len, rbuf, 4);
+                assert(len <= 4096);
+                read_full(fds[i], &rbuf[4], len);
+            }
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    IOTotals after = io_stats_total();
+
+    for (SOCKET fd : fds)
+    {
+        closesocket(fd);
+    }
+
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    uint64_t nreq = after.requests - before.requests;
+    uint64_t nsys = after.syscalls - before.syscalls;
+    printf("%-8s requests=%llu syscalls=%llu syscalls/req=%.3f req/s=%.0f\n",
+           name, (unsigned long long)nreq, (unsigned long long)nsys,
+           nreq ? (double)nsys / (double)nreq : 0.0, (double)nreq / secs);
+}
+
+int main(int argc, char **argv)
+{
+    int nconn = argc > 1 ? atoi(argv[1]) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+    int depth = argc > 3 ? atoi(argv[3]) : 1;
+
+    // both servers stay up until exit; each is idle while the other is measured
+    static ConnectionManager readiness;
+    readiness.initialize(12341);
+    std::thread([] { readiness.run(); }).detach();
+    run_load("epoll", 12341, nconn, rounds, depth);
+
+    static ConnectionManager uring;
+    uring.initialize(12342);
+    std::thread([] {
+        if (!uring.run_uring())
+        {
+            msg("io_uring is unavailable");
+            exit(0);
+        }
+    }).detach();
+    run_load("io_uring", 12342, nconn, rounds, depth);
+
+    // the server threads never return
+    fflush(stdout);
+    _exit(0);
+}
@@ -4,31 +4,21 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <inttypes.h>
+#include <stddef.h>
 #include <string>
 #include <vector>
 #include "common.h"
 
+#ifdef _WIN32
 #pragma comment(lib, "Ws2_32.lib")
-
-static void msg(const char *msg)
-{
-    fprintf(stderr, "%s\n", msg);
-}
-
-static void die(const char *msg)
-{
-    int err = WSAGetLastError();
-    fprintf(stderr, "[%d] %s\n", err, msg);
-    abort();
-}
+#endif
 
 static int32_t read_full(SOCKET fd, char *buf, size_t n)
 {
     while (n > 0)
     {
-        int rv = recv(fd, buf, n, 0);
+        int rv = recv(fd, buf, (int)n, 0);
         if (rv <= 0)
         {
             return -1; // error, or unexpected EOF
@@ -44,7 +34,7 @@ static int32_t write_all(SOCKET fd, const char *buf, size_t n)
 {
     while (n > 0)
     {
-        int rv = send(fd, buf, n, 0);
+        int rv = send(fd, buf, (int)n, 0);
         if (rv <= 0)
         {
             return -1; // error
@@ -56,7 +46,8 @@ static int32_t write_all(SOCKET fd, const char *buf, size_t n)
     return 0;
 }
 
-const size_t k_max_msg = 4096;
+// should be at least the server's --max-msg
+const size_t k_max_msg = 64 << 20;
 
 static int32_t send_req(SOCKET fd, const std::vector<std::string> &cmd)
 {
@@ -70,7 +61,7 @@ static int32_t send_req(SOCKET fd, const std::vector<std::string> &cmd)
         return -1;
     }
 
-    char wbuf[4 + k_max_msg];
+    std::vector<char> wbuf(4 + len);
     memcpy(&wbuf[0], &len, 4); // assume little endian
     uint32_t n = cmd.size();
     memcpy(&wbuf[4], &n, 4);
@@ -82,7 +73,7 @@ static int32_t send_req(SOCKET fd, const std::vector<std::string> &cmd)
         memcpy(&wbuf[cur + 4], s.data(), s.size());
         cur += 4 + s.size();
     }
-    return write_all(fd, wbuf, 4 + len);
+    return write_all(fd, wbuf.data(), 4 + len);
 }
 
 static int32_t on_response(const uint8_t *data, size_t size)
@@ -142,7 +133,7 @@ static int32_t on_response(const uint8_t *data, size_t size)
         {
             int64_t val = 0;
             memcpy(&val, &data[1], 8);
-            printf("(int) %I64d\n", val);
+            printf("(int) %" PRId64 "\n", val);
             return 1 + 8;
         }
     case SER_DBL:
@@ -186,12 +177,13 @@ static int32_t on_response(const uint8_t *data, size_t size)
     }
 }
 
-static int32_t read_res(SOCKET fd)
+// reads one reply, its body is rbuf[4:]
+static int32_t read_reply(SOCKET fd, std::vector<char> &rbuf)
 {
     // 4 bytes header
-    char rbuf[4 + k_max_msg + 1];
+    rbuf.resize(4);
     errno = 0;
-    int32_t err = read_full(fd, rbuf, 4);
+    int32_t err = read_full(fd, rbuf.data(), 4);
     if (err)
     {
         if (errno == 0)
@@ -206,7 +198,7 @@ static int32_t read_res(SOCKET fd)
     }
 
     uint32_t len = 0;
-    memcpy(&len, rbuf, 4); // assume little endian
+    memcpy(&len, rbuf.data(), 4); // assume little endian
     if (len > k_max_msg)
     {
         msg("too long");
@@ -214,14 +206,27 @@ static int32_t read_res(SOCKET fd)
     }
 
     // reply body
+    rbuf.resize(4 + len);
     err = read_full(fd, &rbuf[4], len);
     if (err)
     {
         msg("read() error");
         return err;
     }
+    return 0;
+}
+
+static int32_t read_res(SOCKET fd)
+{
+    std::vector<char> rbuf;
+    int32_t err = read_reply(fd, rbuf);
+    if (err)
+    {
+        return err;
+    }
 
     // print the result
+    size_t len = rbuf.size() - 4;
     int32_t rv = on_response((uint8_t *)&rbuf[4], len);
     if (rv > 0 && (uint32_t)rv != len)
     {
@@ -231,14 +236,171 @@ static int32_t read_res(SOCKET fd)
     return rv;
 }
 
-int main(int argc, char **argv)
+// walks a reply of known shape; ok turns false on anything unexpected
+struct ReplyReader
 {
-    WSADATA wsaData;
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0)
+    const uint8_t *cur;
+    const uint8_t *end;
+    bool ok = true;
+
+    bool tag(uint8_t want, size_t size)
+    {
+        ok = ok && end - cur >= (ptrdiff_t)(1 + size) && cur[0] == want;
+        cur += ok ? 1 : 0;
+        return ok;
+    }
+    uint32_t arr()
+    {
+        uint32_t n = 0;
+        if (tag(SER_ARR, 4))
+        {
+            memcpy(&n, cur, 4);
+            cur += 4;
+        }
+        return n;
+    }
+    int64_t num()
     {
-        die("WSAStartup failed");
+        int64_t val = 0;
+        if (tag(SER_INT, 8))
+        {
+            memcpy(&val, cur, 8);
+            cur += 8;
+        }
+        return val;
     }
+    std::string str()
+    {
+        uint32_t len = 0;
+        if (tag(SER_STR, 4))
+        {
+            memcpy(&len, cur, 4);
+            cur += 4;
+            ok = end - cur >= (ptrdiff_t)len;
+        }
+        if (!ok)
+        {
+            return "";
+        }
+        cur += len;
+        return std::string((const char *)cur - len, len);
+    }
+};
+
+struct BigKey
+{
+    std::string key;
+    int64_t size = 0;
+};
+
+struct TypeStats
+{
+    std::string type;
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t len = 0;
+    std::vector<BigKey> by_bytes; // the top ones, largest first
+    std::vector<BigKey> by_len;
+};
+
+static void keep_top(std::vector<BigKey> &top, size_t n, const std::string &key, int64_t size)
+{
+    if (top.size() == n && size <= top.back().size)
+    {
+        return;
+    }
+    size_t i = top.size();
+    while (i > 0 && top[i - 1].size < size)
+    {
+        i--;
+    }
+    top.insert(top.begin() + i, BigKey{key, size});
+    if (top.size() > n)
+    {
+        top.pop_back();
+    }
+}
+
+const char *k_bigkeys_count = "100";
+
+// iterates BIGKEYS to the end, a few keys per request so the server keeps
+// serving other clients, and prints the largest keys of each type
+static int32_t bigkeys(SOCKET fd, size_t top)
+{
+    std::vector<TypeStats> types;
+    std::string cursor = "0";
+    std::vector<char> rbuf;
+    do
+    {
+        int32_t err = send_req(fd, {"bigkeys", cursor, "count", k_bigkeys_count});
+        if (!err)
+        {
+            err = read_reply(fd, rbuf);
+        }
+        if (err)
+        {
+            return err;
+        }
+
+        ReplyReader r{(const uint8_t *)&rbuf[4], (const uint8_t *)rbuf.data() + rbuf.size()};
+        if (r.arr() != 2)
+        {
+            on_response((const uint8_t *)&rbuf[4], rbuf.size() - 4); // the error
+            return -1;
+        }
+        cursor = std::to_string(r.num());
+        uint32_t n = r.arr() / 4;
+        for (uint32_t i = 0; i < n && r.ok; ++i)
+        {
+            std::string key = r.str();
+            std::string type = r.str();
+            int64_t bytes = r.num();
+            int64_t len = r.num();
+            size_t t = 0;
+            while (t < types.size() && types[t].type != type)
+            {
+                t++;
+            }
+            if (t == types.size())
+            {
+                types.emplace_back();
+                types[t].type = type;
+            }
+            TypeStats &ts = types[t];
+            ts.keys++;
+            ts.bytes += (uint64_t)bytes;
+            ts.len += (uint64_t)len;
+            keep_top(ts.by_bytes, top, key, bytes);
+            keep_top(ts.by_len, top, key, len);
+        }
+        if (!r.ok)
+        {
+            msg("bad response");
+            return -1;
+        }
+    } while (cursor != "0");
+
+    for (const TypeStats &ts : types)
+    {
+        printf("%s: %" PRIu64 " keys, %" PRIu64 " bytes, %" PRIu64 " %s\n",
+               ts.type.c_str(), ts.keys, ts.bytes, ts.len,
+               ts.type == "string" ? "value bytes" : "members");
+        for (const BigKey &k : ts.by_bytes)
+        {
+            printf("  %12" PRId64 " bytes    %s\n", k.size, k.key.c_str());
+        }
+        for (const BigKey &k : ts.by_len)
+        {
+            printf("  %12" PRId64 " %s  %s\n", k.size,
+                   ts.type == "string" ? "long   " : "members", k.key.c_str());
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    net_init();
 
     SOCKET fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (fd == INVALID_SOCKET)
@@ -256,24 +418,26 @@ int main(int argc, char **argv)
         die("connect");
     }
 
-    std::vector<std::string> cmd;
-    for (int i = 1; i < argc; ++i)
-    {
-        cmd.push_back(argv[i]);
-    }
-    int32_t err = send_req(fd, cmd);
-    if (err)
+    // client --bigkeys [n]: the n largest keys of each type
+    if (argc > 1 && strcmp(argv[1], "--bigkeys") == 0)
     {
-        goto L_DONE;
+        long top = argc > 2 ? atol(argv[2]) : 5;
+        bigkeys(fd, top > 0 ? (size_t)top : 5);
     }
-    err = read_res(fd);
-    if (err)
+    else
     {
-        goto L_DONE;
+        std::vector<std::string> cmd;
+        for (int i = 1; i < argc; ++i)
+        {
+            cmd.push_back(argv[i]);
+        }
+        if (send_req(fd, cmd) == 0)
+        {
+            read_res(fd);
+        }
     }
 
-L_DONE:
     closesocket(fd);
-    WSACleanup();
+    net_cleanup();
     return 0;
 }
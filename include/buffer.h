@@ -0,0 +1,28 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A growable byte buffer. The memory comes from a pool of power-of-2 sized
+// blocks shared by all connections, and is handed back to the pool as soon
+// as the buffer drains, so an idle connection holds no buffer memory.
+struct Buffer
+{
+    uint8_t *data = nullptr;
+    size_t size = 0; // bytes in use
+    size_t cap = 0;
+};
+
+// make room for at least n more bytes
+void buf_reserve(Buffer *buf, size_t n);
+void buf_append(Buffer *buf, const void *data, size_t n);
+// remove n bytes from the front
+void buf_consume(Buffer *buf, size_t n);
+// return the memory to the pool, the content is discarded
+void buf_release(Buffer *buf);
+
+// bytes currently cached by the pool
+size_t buf_pool_cached();
+
+#endif // BUFFER_H
@@ -3,9 +3,52 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include "datastore.h"
 
+// where a command runs when the keyspace is sharded
+enum CmdRoute
+{
+  ROUTE_LOCAL = 0, // on the shard that received it
+  ROUTE_KEY = 1,   // on the shard owning cmd[1]
+  ROUTE_ALL = 2,   // on every shard, the array replies are concatenated
+  ROUTE_MULTI = 3, // split by the owners of its keys, the replies are combined
+  ROUTE_CURSOR = 4, // on the shard encoded in the cursor cmd[1] (see do_scan)
+  ROUTE_SUBKEY = 5, // on the shard owning cmd[2], after a subcommand
+};
+
+enum CmdFlags
+{
+  CMD_READ = 1,
+  CMD_WRITE = 2,
+  CMD_SLOW = 4, // may take time proportional to the data size
+  CMD_GROW = 8, // may use more memory, refused over maxmemory
+};
+
+typedef void (*CmdHandler)(std::vector<std::string_view> &cmd, Buffer &out);
+
+// One entry of the command table. The arity counts the command name:
+// N means exactly N arguments, -N at least N.
+struct Command
+{
+  const char *name;
+  CmdHandler handler;
+  int32_t arity;
+  uint32_t flags;
+  CmdRoute route;
+  uint32_t id; // index into the table and into g_cmd_stats (stats.h)
+  // ROUTE_MULTI: the keys are cmd[1], cmd[1 + key_step], ...
+  uint32_t key_step = 1;
+};
+
 // Function Declaration
-void do_request(std::vector<std::string> &cmd, std::string &out);
+// client is the requesting socket, for the slowlog
+void do_request(std::vector<std::string_view> &cmd, Buffer &out, SOCKET client);
+// case-insensitive compare with a lowercase name
+bool cmd_is(std::string_view word, const char *cmd);
+// case-insensitive, NULL for an unknown command
+const Command *cmd_lookup(std::string_view name);
+const Command *cmd_table(size_t *n);
+CmdRoute cmd_route(const std::vector<std::string_view> &cmd);
 
 #endif // COMMANDS_H
@@ -2,20 +2,141 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <strings.h>
+// POSIX spellings of the Winsock names used throughout the code
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define _stricmp strcasecmp
+#endif
 
 #define container_of(ptr, type, member) \
   (reinterpret_cast<type *>(            \
       reinterpret_cast<char *>(ptr) - offsetof(type, member)))
 
-inline uint32_t str_hash(const uint8_t *data, size_t len)
+// per-process random seed of str_hash, so keys that collide cannot be
+// crafted ahead of time (set before main, see common.cpp)
+extern uint64_t g_hash_seed;
+
+const uint64_t k_hash_s0 = 0xa0761d6478bd642full, k_hash_s1 = 0xe7037ed1a0b428dbull;
+const uint64_t k_hash_s2 = 0x8ebc6af09c88c6e3ull, k_hash_s3 = 0x589965cc75374cc3ull;
+
+// 64x64 -> 128 bit multiply, returns the low half in a and the high in b
+inline void hash_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+  *a = _umul128(*a, *b, b);
+#elif defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+  hash_mum(&a, &b);
+  return a ^ b;
+}
+
+inline uint64_t hash_rd64(const uint8_t *p)
 {
-  uint32_t h = 0x811C9DC5;
-  for (size_t i = 0; i < len; i++)
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t hash_rd32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// wyhash: 8 bytes per load folded with 128-bit multiplies, 3 independent
+// lanes over 48-byte blocks so long keys keep the multiplier busy
+inline uint64_t str_hash(const uint8_t *data, size_t len)
+{
+  const uint64_t s0 = k_hash_s0, s1 = k_hash_s1, s2 = k_hash_s2, s3 = k_hash_s3;
+  const uint8_t *p = data;
+  uint64_t seed = g_hash_seed;
+  uint64_t a, b;
+  if (len <= 16)
+  {
+    if (len >= 4)
+    {
+      // two overlapping pairs of 4-byte loads cover 4..16 bytes
+      size_t mid = (len >> 3) << 2;
+      a = (hash_rd32(p) << 32) | hash_rd32(p + mid);
+      b = (hash_rd32(p + len - 4) << 32) | hash_rd32(p + len - 4 - mid);
+    }
+    else if (len > 0)
+    {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    }
+    else
+    {
+      a = b = 0;
+    }
+  }
+  else
   {
-    h = (h + data[i]) * 0x01000193;
+    size_t i = len;
+    if (i > 48)
+    {
+      uint64_t see1 = seed, see2 = seed;
+      do
+      {
+        seed = hash_mix(hash_rd64(p) ^ s1, hash_rd64(p + 8) ^ seed);
+        see1 = hash_mix(hash_rd64(p + 16) ^ s2, hash_rd64(p + 24) ^ see1);
+        see2 = hash_mix(hash_rd64(p + 32) ^ s3, hash_rd64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16)
+    {
+      seed = hash_mix(hash_rd64(p) ^ s1, hash_rd64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    // the last 16 bytes, overlapping what was already mixed
+    a = hash_rd64(p + i - 16);
+    b = hash_rd64(p + i - 8);
   }
-  return h;
+  a ^= s1;
+  b ^= seed;
+  hash_mum(&a, &b);
+  return hash_mix(a ^ s0 ^ len, b ^ s1);
 }
 
 enum ErrorCode
@@ -24,6 +145,7 @@ enum ErrorCode
   ERR_2BIG,
   ERR_TYPE,
   ERR_ARG,
+  ERR_OOM, // over maxmemory and nothing could be evicted
 };
 
 enum
@@ -38,4 +160,14 @@ enum
 
 void msg(const char *s);
 void die(const char *s);
-void fd_set_nb(SOCKET fd);
\ No newline at end of file
+void fd_set_nb(SOCKET fd);
+// monotonic clock, for timeouts and durations
+uint64_t get_monotonic_usec();
+uint64_t get_monotonic_nsec();
+
+// socket layer helpers, hiding the Winsock/POSIX differences
+void net_init();
+void net_cleanup();
+int net_errno();
+bool net_would_block(int err);
+bool net_interrupted(int err);
@@ -1,38 +1,67 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
-#include <winsock2.h>
+#include <string_view>
 #include <vector>
 #include "protocol.h"
 #include "common.h"
+#include "buffer.h"
+#include "list.h"
+#include "poller.h"
+#include "uring.h"
+
+struct ShardMsg;
 
 struct Conn
 {
   SOCKET fd = INVALID_SOCKET;
   std::uint32_t state = 0; // either STATE_REQ or STATE_RES
   // buffer for reading
-  size_t rbuf_size = 0;
-  uint8_t rbuf[4 + k_max_msg];
-  // buffer for writing
-  size_t wbuf_size = 0;
+  Buffer rbuf;
+  // output queue, responses to pipelined requests are appended back to back
+  Buffer wbuf;
   size_t wbuf_sent = 0;
-  uint8_t wbuf[4 + k_max_msg];
+  // arguments of the request being executed, they point into rbuf
+  std::vector<std::string_view> args;
+  // io_uring backend: operations still owned by the kernel
+  std::uint32_t io_ops = 0;
+  // sharding: replies still expected from other shards, and the parts
+  // of the result gathered so far
+  std::uint32_t shard_wait = 0;
+  std::vector<ShardMsg *> shard_parts;
+  // idle timer, in the manager's idle_list ordered by last activity
+  uint64_t idle_start = 0;
+  DList idle_list;
 };
 
+// close connections without I/O for this long, 0 disables, set with --idle-timeout
+extern uint64_t g_idle_timeout_ms;
+
 class ConnectionManager
 {
 public:
   ConnectionManager();
   ~ConnectionManager();
-  void initialize();
+  void initialize(uint16_t port = 1234);
   void run();
+  // io_uring completion loop; returns false if io_uring is unavailable
+  bool run_uring();
 
 private:
   SOCKET listen_fd;
   std::vector<Conn *> fd2conn;
-  void accept_new_conn();
+  Poller poller;
+  // connections by last activity, the oldest first
+  DList idle_list;
+  bool accept_new_conn();
+  Conn *register_conn(SOCKET connfd);
   void handle_connection_io(Conn *conn);
   void cleanup_connection(Conn *conn);
+  void handle_shard_msgs();
+  void resume_conn(Conn *conn);
+  void conn_touch(Conn *conn);
+  int next_timer_ms();
+  Conn *pop_expired();
 };
 
 #endif // CONNECTION_H
@@ -2,57 +2,173 @@
 #define DATASTORE_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include "hashtable.h"
+#include "heap.h"
 #include "zset.h"
+#include "hash.h"
+#include "deque.h"
+#include "serialize.h"
+
+// a key sampled for eviction; the pool keeps the best ones sampled so far
+struct EvictCand
+{
+  uint64_t score = 0; // idle time or inverse frequency, the highest goes first
+  std::string key;
+};
 
 // Data Store Structure
 struct DataStore
 {
   HMap db;
+  // expiry times in ms (get_monotonic_usec() / 1000) of the keys with a TTL
+  std::vector<HeapItem> heap;
+  // bytes of the entries and their values, see entry_mem()
+  size_t mem = 0;
+  std::vector<EvictCand> evict_pool; // ascending score
+  uint64_t evicted = 0;
+};
+
+enum EvictPolicy
+{
+  EVICT_NONE = 0, // refuse writes that need memory
+  EVICT_LRU = 1,
+  EVICT_LFU = 2,
 };
 
-// External DataStore instance
-extern DataStore g_data;
+// memory limit in bytes, 0 for none, split evenly among the shards;
+// set with --maxmemory and --maxmemory-policy
+extern size_t g_maxmemory;
+extern std::uint32_t g_evict_policy;
+
+// External DataStore instance, one shard of the keyspace per reactor thread
+extern thread_local DataStore g_data;
 
 enum EntryType
 {
   T_STR = 0,
   T_ZSET = 1,
+  T_HASH = 2,
+  T_LIST = 3,
+};
+
+// how a T_STR value is stored
+enum EntryEncoding
+{
+  ENC_RAW = 0, // bytes, inline or in heap
+  ENC_INT = 1, // a canonical decimal int64, in ival
 };
-// the structure for the key
+
+const std::uint32_t k_no_ttl = UINT32_MAX;
+
+// A key and its value in one allocation: these fields, then the key
+// bytes, then vcap bytes reserved for a small string value. A string that
+// outgrows them moves to a buffer of its own.
 struct Entry
 {
   struct HNode node;
-  std::string key;
-  std::string val;
-  std::uint32_t type = 0;
-  ZSet *zset = NULL;
+  std::uint32_t klen = 0;
+  std::uint32_t vlen = 0; // T_STR
+  std::uint32_t heap_idx = k_no_ttl; // in g_data.heap
+  std::uint32_t vcap : 7;
+  std::uint32_t type : 3;
+  std::uint32_t enc : 2;
+  // LRU: the clock at the last access, in seconds; LFU: the minute the
+  // counter last decayed, above an 8-bit logarithmic access counter
+  std::uint32_t access : 20;
+  union
+  {
+    char *heap = NULL; // ENC_RAW, NULL while the value is inline
+    int64_t ival;      // ENC_INT
+    ZSet *zset;        // T_ZSET
+    Hash *hash;        // T_HASH
+    Deque *list;       // T_LIST
+  };
+
+  Entry() : vcap(0), type(T_STR), enc(ENC_RAW), access(0) {}
 };
 
+// strings up to this size are stored inline when the entry is created,
+// at most 127 for vcap
+const size_t k_inline_val_max = 64;
+
+// room for any int64 in decimal
+const size_t k_int_str_size = 24;
+
+Entry *entry_new(std::string_view key, uint64_t hcode, std::uint32_t type,
+                 std::string_view val = {});
+std::string_view entry_key(const Entry *ent);
+// the string value; an ENC_INT one is formatted into buf
+std::string_view entry_str(const Entry *ent, char (&buf)[k_int_str_size]);
+// values that look like integers are stored as ENC_INT
+void entry_set_str(Entry *ent, std::string_view val);
+void entry_set_int(Entry *ent, int64_t val);
+// expire the key ttl_ms from now, or never if ttl_ms is negative
+void entry_set_ttl(Entry *ent, int64_t ttl_ms);
+
+// free an entry removed from the db, large values in the background
+void entry_del(Entry *ent);
+// bytes of an entry and its value
+size_t entry_mem(Entry *ent);
+
+// bytes used by this shard's keyspace
+size_t db_used_memory();
+// Evict keys until the shard is under its share of maxmemory. Returns
+// false if it is still over, for the caller to refuse the request.
+bool db_evict();
+
+// time per event loop round spent removing expired keys
+const uint64_t k_expire_usec = 1000;
+
+// Remove expired keys for up to budget_usec. Returns whether some are left.
+bool db_expire(uint64_t budget_usec);
+// poll timeout until the next key expires, -1 if none has a TTL
+int db_next_timer_ms();
+
+// time an idle event loop spends moving the db along a resize
+const uint64_t k_idle_rehash_usec = 1000;
+
+// Advance a resize of the db for up to budget_usec, so an idle server
+// finishes it and frees the old table. Returns whether work is left;
+// a budget of 0 only checks.
+bool db_rehash(uint64_t budget_usec);
+
+// copy this shard's keyspace figures to g_db_stats for INFO; once per
+// event loop round
+void db_publish_stats();
+
 // Function Declarations for Commands
-void do_get(std::vector<std::string> &cmd, std::string &out);
-void do_set(std::vector<std::string> &cmd, std::string &out);
-void do_del(std::vector<std::string> &cmd, std::string &out);
-void do_keys(std::vector<std::string> &cmd, std::string &out);
-void do_zadd(std::vector<std::string> &cmd, std::string &out);
-void do_zrem(std::vector<std::string> &cmd, std::string &out);
-void do_zscore(std::vector<std::string> &cmd, std::string &out);
-void do_zquery(std::vector<std::string> &cmd, std::string &out);
+void do_get(std::vector<std::string_view> &cmd, Buffer &out);
+void do_set(std::vector<std::string_view> &cmd, Buffer &out);
+void do_del(std::vector<std::string_view> &cmd, Buffer &out);
+void do_keys(std::vector<std::string_view> &cmd, Buffer &out);
+void do_mget(std::vector<std::string_view> &cmd, Buffer &out);
+void do_mset(std::vector<std::string_view> &cmd, Buffer &out);
+void do_scan(std::vector<std::string_view> &cmd, Buffer &out);
+void do_incr(std::vector<std::string_view> &cmd, Buffer &out);
+void do_incrbyfloat(std::vector<std::string_view> &cmd, Buffer &out);
+void do_expire(std::vector<std::string_view> &cmd, Buffer &out);
+void do_ttl(std::vector<std::string_view> &cmd, Buffer &out);
+void do_memory(std::vector<std::string_view> &cmd, Buffer &out);
+void do_bigkeys(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zadd(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zrem(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zscore(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zquery(std::vector<std::string_view> &cmd, Buffer &out);
+void do_hset(std::vector<std::string_view> &cmd, Buffer &out);
+void do_hget(std::vector<std::string_view> &cmd, Buffer &out);
+void do_hdel(std::vector<std::string_view> &cmd, Buffer &out);
+void do_hgetall(std::vector<std::string_view> &cmd, Buffer &out);
+void do_hincrby(std::vector<std::string_view> &cmd, Buffer &out);
+void do_push(std::vector<std::string_view> &cmd, Buffer &out);
+void do_pop(std::vector<std::string_view> &cmd, Buffer &out);
+void do_lrange(std::vector<std::string_view> &cmd, Buffer &out);
+void do_llen(std::vector<std::string_view> &cmd, Buffer &out);
 
 // Utility Functions
-bool str2dbl(const std::string &s, double &out);
-bool str2int(const std::string &s, int64_t &out);
-bool expect_zset(std::string &out, std::string &s, Entry **ent);
-
-// Serialization Functions
-void out_nil(std::string &out);
-void out_str(std::string &out, const std::string &val);
-void out_int(std::string &out, int64_t val);
-void out_dbl(std::string &out, double val);
-void out_err(std::string &out, int32_t code, const std::string &m);
-void out_arr(std::string &out, std::uint32_t n);
-size_t begin_arr(std::string &out);
-void end_arr(std::string &out, size_t ctx, std::uint32_t n);
+bool str2dbl(std::string_view s, double &out);
+bool str2int(std::string_view s, int64_t &out);
+bool expect_zset(Buffer &out, std::string_view s, Entry **ent);
 
 #endif // DATASTORE_H
\ No newline at end of file
@@ -0,0 +1,45 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "list.h"
+
+// A list of byte strings as a linked list of chunks, each one allocation
+// of elements packed back to back. An element is its length, the bytes,
+// and the length again so a chunk can be walked from either end; a length
+// is 1 byte, or 0xFF and 4 more bytes. The elements of a chunk sit between
+// begin and end, a push at the front goes before begin and one at the back
+// after end, or into a new chunk, so both ends are O(1).
+struct Deque
+{
+  DList chunks;
+  size_t count = 0; // elements
+  size_t mem = 0;   // bytes of the chunks, for the memory accounting
+};
+
+struct DequeChunk
+{
+  DList link;
+  uint32_t begin = 0; // offsets into the data after the header
+  uint32_t end = 0;
+  uint32_t count = 0;
+  uint32_t cap = 0;
+};
+
+// bytes of a chunk, header included; longer elements get a chunk of their own
+const size_t k_deque_chunk_size = 4096;
+
+void deque_push(Deque *deque, std::string_view val, bool front);
+// the first or last element, valid until the deque is changed
+bool deque_peek(Deque *deque, bool front, std::string_view *val);
+void deque_pop(Deque *deque, bool front);
+// visit n elements from index start, which must be in the deque
+void deque_range(Deque *deque, size_t start, size_t n,
+                 void (*f)(std::string_view val, void *arg), void *arg);
+void deque_dispose(Deque *deque);
+// bytes of the deque and its chunks
+size_t deque_mem(Deque *deque);
+
+#endif // DEQUE_H
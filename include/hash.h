@@ -0,0 +1,48 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "hashtable.h"
+
+// A field -> value map. A small one is a packed list in one buffer,
+// searched linearly: for each field a uint32 length and the bytes, then a
+// uint32 length and the value bytes. Past k_hash_packed_fields fields, or
+// on a field or value longer than k_hash_packed_len, it converts to an
+// HMap of HField nodes and stays that way.
+struct Hash
+{
+  char *packed = NULL;  // NULL once converted
+  uint32_t used = 0;    // bytes of the packed list
+  uint32_t cap = 0;
+  uint32_t count = 0;   // fields, in either encoding
+  bool is_map = false;
+  HMap hmap;
+  size_t mem = 0;       // bytes of the HField nodes, for the memory accounting
+};
+
+// one field of a converted hash: these fields, the name, then the value
+struct HField
+{
+  HNode node;
+  uint32_t flen = 0;
+  uint32_t vlen = 0;
+};
+
+const uint32_t k_hash_packed_fields = 64;
+const size_t k_hash_packed_len = 64;
+
+// returns whether the field is new
+bool hash_set(Hash *hash, std::string_view field, std::string_view val);
+// the view is valid until the hash is changed
+bool hash_get(Hash *hash, std::string_view field, std::string_view *val);
+bool hash_del(Hash *hash, std::string_view field);
+// visit every field, the hash must not change meanwhile
+void hash_foreach(Hash *hash, void (*f)(std::string_view field, std::string_view val, void *arg),
+                  void *arg);
+void hash_dispose(Hash *hash);
+// bytes of the hash, its packed list or its nodes and hashtable
+size_t hash_mem(Hash *hash);
+
+#endif // HASH_H
@@ -11,6 +11,7 @@ struct HNode
     uint64_t hcode = 0;
 };
 
+#ifndef HMAP_SWISS
 // a simple fixed-sized hashtable
 struct HTab
 {
@@ -18,8 +19,22 @@ struct HTab
     size_t mask = 0;
     size_t size = 0;
 };
+#else
+// open addressing: slots in groups of 16, each with a control byte holding
+// 7 bits of the hash, or the empty / deleted marker (swisstable.cpp)
+struct HTab
+{
+    uint8_t *ctrl = NULL;
+    HNode **slots = NULL;
+    size_t gmask = 0; // number of groups - 1
+    size_t size = 0;
+    size_t deleted = 0;
+};
+#endif
 
 // 2 hashtables for progressive resizing.
+// Built with -DHMAP_SWISS the same API runs on the open addressing tables
+// of swisstable.cpp instead of the chained ones of hashtable.cpp.
 struct HMap
 {
     HTab ht1; // newer
@@ -27,10 +42,40 @@ struct HMap
     size_t resizing_pos = 0;
 };
 
+struct HMapStats
+{
+    size_t size = 0;
+    size_t buckets = 0;        // slots of the newer table
+    size_t rehash_buckets = 0; // slots of the older one, 0 if not resizing
+    size_t rehash_pos = 0;
+    size_t bytes = 0; // of the tables, not counting the nodes
+};
+
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
+// Move up to nwork nodes of a resize in progress, which otherwise only
+// advances a little with each lookup, insert or pop. Returns whether a
+// resize is still in progress. The map grows on insert and shrinks on pop.
+bool hm_rehash(HMap *hmap, size_t nwork);
+// Warm the cache for a later lookup of hcode. A batch of lookups calls the
+// slot prefetch for every key, then the chain prefetch, then looks them up,
+// so the memory accesses of the whole batch overlap.
+void hm_prefetch_slot(HMap *hmap, uint64_t hcode);
+void hm_prefetch_chain(HMap *hmap, uint64_t hcode);
 void hm_destroy(HMap *hmap);
+// Visit every node once, the map must not change meanwhile.
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg);
+void hm_stats(HMap *hmap, HMapStats *stats);
+// Copy up to n nodes to out from the buckets following pos (any number,
+// taken modulo the table size), for sampling the map at random. Gives up
+// after a few buckets per wanted node, so it may return fewer.
+size_t hm_sample(HMap *hmap, size_t pos, HNode **out, size_t n);
+// Visit one step of the table and return the cursor of the next, 0 when
+// done. The cursor counts over the bucket index bits in reverse, so a scan
+// started with 0 sees every node that stays in the map from start to end,
+// even if the map is resized in between; some nodes may be seen twice.
+size_t hm_scan(HMap *hmap, size_t cursor, void (*f)(HNode *, void *), void *arg);
 
 #endif // HASHTABLE_H
\ No newline at end of file
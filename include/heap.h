@@ -0,0 +1,19 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// an item of a binary min-heap kept in an array; ref points to where the
+// owner keeps the item's index, updated whenever the item moves
+struct HeapItem
+{
+    uint64_t val = 0;
+    uint32_t *ref = NULL;
+};
+
+// restore the heap order after a[pos].val changed, or after a new item
+// was put at pos
+void heap_update(HeapItem *a, size_t pos, size_t len);
+
+#endif // HEAP_H
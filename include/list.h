@@ -0,0 +1,38 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include <stddef.h>
+
+// An intrusive circular doubly-linked list. A node starts out linked to
+// itself, which also serves as the list head; detaching is O(1) and may be
+// repeated.
+struct DList
+{
+  DList *prev = this;
+  DList *next = this;
+};
+
+inline bool dlist_empty(DList *node)
+{
+  return node->next == node;
+}
+
+inline void dlist_detach(DList *node)
+{
+  DList *prev = node->prev;
+  DList *next = node->next;
+  prev->next = next;
+  next->prev = prev;
+  node->prev = node->next = node;
+}
+
+inline void dlist_insert_before(DList *target, DList *rookie)
+{
+  DList *prev = target->prev;
+  prev->next = rookie;
+  rookie->prev = prev;
+  rookie->next = target;
+  target->prev = rookie;
+}
+
+#endif // LIST_H
@@ -0,0 +1,50 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+
+// interest / readiness bits
+enum
+{
+  POLL_IN = 1,
+  POLL_OUT = 2,
+  POLL_ERR = 4,
+};
+
+struct PollEvent
+{
+  SOCKET fd = INVALID_SOCKET;
+  std::uint32_t events = 0;
+};
+
+// Readiness notification. On Linux this is an edge-triggered epoll instance,
+// so callers must drain a socket until it would block before waiting again.
+// Elsewhere it falls back to select(), which is level-triggered and thus also
+// fine with that usage.
+class Poller
+{
+public:
+  Poller();
+  ~Poller();
+  void add(SOCKET fd, std::uint32_t interest);
+  void mod(SOCKET fd, std::uint32_t interest);
+  void del(SOCKET fd);
+  // wait for events, timeout_ms < 0 blocks forever
+  int wait(std::vector<PollEvent> &events, int timeout_ms);
+
+private:
+#ifdef __linux__
+  int epfd;
+#else
+  struct Watch
+  {
+    SOCKET fd;
+    std::uint32_t interest;
+  };
+  std::vector<Watch> watches;
+#endif
+};
+
+#endif // POLLER_H
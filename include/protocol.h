@@ -3,10 +3,16 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include "common.h"
+#include "stats.h"
 
 // Constants
-constexpr size_t k_max_msg = 4096;
+constexpr size_t k_default_max_msg = 4 << 20;
+// the smallest amount of free space offered to a single recv
+constexpr size_t k_read_chunk = 4096;
+// stop executing pipelined requests once this much output is queued
+constexpr size_t k_wbuf_high_water = 64 * 1024;
 
 // State Definitions
 enum
@@ -19,8 +25,16 @@ enum
 // Connection Structure
 struct Conn;
 
+// largest request or response payload, set with --max-msg
+extern size_t g_max_msg;
+
 // Function Declarations
-bool try_one_request(Conn *conn);
+struct Buffer;
+// execute a parsed request and append its length-prefixed response
+void exec_request(std::vector<std::string_view> &cmd, Buffer &out, SOCKET client);
+size_t rbuf_want(Conn *conn);
+bool process_requests(Conn *conn);
+bool try_requests(Conn *conn);
 bool try_fill_buffer(Conn *conn);
 bool try_flush_buffer(Conn *conn);
 void state_req(Conn *conn);
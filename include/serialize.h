@@ -0,0 +1,83 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+#include "buffer.h"
+#include "common.h"
+#include "protocol.h"
+
+// Response encoders. They write straight into the connection's output
+// buffer. Each SER_* tag has its own encoder whose size is known at compile
+// time, so encoding a value is one capacity check plus a few stores.
+
+template <uint8_t Tag, typename T>
+inline void out_fixed(Buffer &out, T val)
+{
+  buf_reserve(&out, 1 + sizeof(T));
+  uint8_t *p = &out.data[out.size];
+  p[0] = Tag;
+  memcpy(&p[1], &val, sizeof(T));
+  out.size += 1 + sizeof(T);
+}
+
+inline void out_nil(Buffer &out)
+{
+  buf_reserve(&out, 1);
+  out.data[out.size++] = SER_NIL;
+}
+
+inline void out_int(Buffer &out, int64_t val)
+{
+  out_fixed<SER_INT>(out, val);
+}
+
+inline void out_dbl(Buffer &out, double val)
+{
+  out_fixed<SER_DBL>(out, val);
+}
+
+inline void out_arr(Buffer &out, uint32_t n)
+{
+  out_fixed<SER_ARR>(out, n);
+}
+
+inline void out_str(Buffer &out, std::string_view val)
+{
+  out_fixed<SER_STR>(out, (uint32_t)val.size());
+  buf_append(&out, val.data(), val.size());
+}
+
+inline void out_err(Buffer &out, int32_t code, std::string_view m)
+{
+  out_fixed<SER_ERR>(out, code);
+  uint32_t len = (uint32_t)m.size();
+  buf_append(&out, &len, 4);
+  buf_append(&out, m.data(), m.size());
+}
+
+// an array whose length is patched in place once it is known.
+// positions are offsets since the buffer may move as it grows.
+inline size_t begin_arr(Buffer &out)
+{
+  out_arr(out, 0); // placeholder for the array length
+  return out.size - 4;
+}
+
+inline void end_arr(Buffer &out, size_t ctx, uint32_t n)
+{
+  assert(out.data[ctx - 1] == SER_ARR);
+  memcpy(&out.data[ctx], &n, 4);
+}
+
+// whether a reply begun at start is past --max-msg. The commands whose
+// replies grow with the data stop encoding then, and the reply is replaced
+// by ERR_2BIG (exec_request) instead of being built in full first.
+inline bool out_too_big(const Buffer &out, size_t start)
+{
+  return out.size - start > g_max_msg;
+}
+
+#endif // SERIALIZE_H
@@ -0,0 +1,130 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "buffer.h"
+#include "common.h"
+
+struct Conn;
+
+// A bounded lock-free queue between exactly one producer thread and one
+// consumer thread. Each side caches the other side's index so the shared
+// cache lines are only touched when the cached view runs out.
+template <typename T, size_t N>
+class SpscQueue
+{
+  static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+  bool push(T val)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head_cache == N)
+    {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache == N)
+      {
+        return false; // full
+      }
+    }
+    slots[t & (N - 1)] = val;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &val)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail_cache)
+    {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h == tail_cache)
+      {
+        return false; // empty
+      }
+    }
+    val = slots[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  // consumer side
+  alignas(64) std::atomic<size_t> head{0};
+  size_t tail_cache = 0;
+  // producer side
+  alignas(64) std::atomic<size_t> tail{0};
+  size_t head_cache = 0;
+  alignas(64) T slots[N];
+};
+
+// A request forwarded to the shard that owns its key, or in I/O threads
+// mode a batch of parsed requests for the execution thread. The same object
+// carries the reply back to the thread holding the connection.
+struct ShardMsg
+{
+  uint32_t from = 0; // the shard holding the connection
+  bool is_reply = false;
+  Conn *conn = nullptr; // only touched by the origin shard
+  SOCKET client = INVALID_SOCKET; // its socket, for the slowlog
+  std::string req;      // the request body, without the length prefix
+  // batch: the arguments of each request back to back, they point into rbuf
+  Buffer rbuf;
+  std::vector<std::string_view> args;
+  std::vector<uint32_t> argc;
+  // multi-key part: the ordinals of its keys in the original request
+  std::vector<uint32_t> pos;
+  Buffer reply; // encoded by the owner shard, length-prefixed for a batch
+};
+
+const uint32_t k_no_shard = ~(uint32_t)0;
+
+// Shared-nothing sharding: every reactor thread owns one shard of the
+// keyspace (its thread-local g_data) and talks to the others only through
+// per-pair SPSC queues. Must be set up before the reactor threads start.
+void shard_init(uint32_t n);
+// I/O threads mode: shards 0..nio-1 only do I/O, the last thread owns the
+// whole keyspace and executes every request
+void shard_init_offload(uint32_t nio);
+uint32_t shard_count();
+// the execution thread, k_no_shard unless in I/O threads mode
+uint32_t shard_exec_id();
+void shard_bind(uint32_t id);
+uint32_t shard_self();
+uint32_t shard_of(std::string_view key);
+// how many shards hold keys: 1 unless sharded with --threads
+uint32_t shard_key_owners();
+
+// run the request here, or hand it to the owning shard(s); returns true if
+// the connection now waits for a reply from another shard
+bool shard_forward(Conn *conn, std::vector<std::string_view> &cmd,
+                   const uint8_t *body, size_t len);
+// hand a parsed batch to the execution thread
+void shard_offload(Conn *conn, ShardMsg *batch);
+// take a reply for the connection. once all the parts are in, the combined
+// result is moved into the output queue and true is returned.
+bool shard_merge_reply(Conn *conn, ShardMsg *msg);
+// drop the parts of an unfinished result
+void shard_parts_free(Conn *conn);
+// execute a request or batch sent by another shard, and send it back
+void shard_execute(ShardMsg *msg);
+// the loop of the execution thread
+void shard_exec_loop();
+
+// queue a message for another shard, it is pushed by shard_flush()
+void shard_send(uint32_t to, ShardMsg *msg);
+// push the queued messages and wake up their receivers.
+// returns true if some queue was full and messages are still waiting.
+bool shard_flush();
+// polled by the reactor, readable when messages have arrived
+SOCKET shard_wake_fd();
+void shard_wake_ack();
+// next incoming message, NULL when all inboxes are empty
+ShardMsg *shard_recv();
+
+#endif // SHARD_H
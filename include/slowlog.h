@@ -0,0 +1,22 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+#include "common.h"
+#include "serialize.h"
+
+// requests slower than this are logged, < 0 disables, set with --slowlog-usec
+extern int64_t g_slowlog_usec;
+// entries kept, the oldest are dropped first, set with --slowlog-len
+extern size_t g_slowlog_len;
+
+// record a request if it took longer than the threshold. The log is shared
+// by all threads; only requests above the threshold take its lock.
+void slowlog_record(const std::vector<std::string_view> &cmd, uint64_t usec, SOCKET client);
+
+// SLOWLOG GET [count] | LEN | RESET
+void do_slowlog(std::vector<std::string_view> &cmd, Buffer &out);
+
+#endif // SLOWLOG_H
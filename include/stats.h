@@ -0,0 +1,154 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// A counter written by its own thread only and read by any thread. A relaxed
+// load+store is as cheap as a plain increment, no locked instruction.
+struct Counter
+{
+  std::atomic<uint64_t> val{0};
+
+  void add(uint64_t n)
+  {
+    val.store(val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  void operator++(int) { add(1); }
+  void operator+=(uint64_t n) { add(n); }
+  void operator-=(uint64_t n) { add(0 - n); } // sums of gauges wrap back
+  void set(uint64_t n) { val.store(n, std::memory_order_relaxed); }
+  uint64_t get() const { return val.load(std::memory_order_relaxed); }
+};
+
+// HDR-style log-linear histogram: every power of 2 is split into
+// 2^k_hist_sub_bits linear sub-buckets, so a recorded value is off by at
+// most 1/16 (6.25%). Values above 2^k_hist_max_bits are clamped.
+const uint32_t k_hist_sub_bits = 4;
+const uint32_t k_hist_max_bits = 36; // ~68 seconds in nanoseconds
+const uint32_t k_hist_buckets = (k_hist_max_bits - k_hist_sub_bits + 1) << k_hist_sub_bits;
+
+struct Histogram
+{
+  Counter counts[k_hist_buckets];
+  Counter total;
+  Counter sum;
+  Counter max;
+};
+
+void hist_record(Histogram *h, uint64_t val);
+
+// a histogram merged from several threads, for reading
+struct HistSum
+{
+  std::vector<uint64_t> counts = std::vector<uint64_t>(k_hist_buckets);
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+};
+
+void hist_merge(HistSum *dst, const Histogram *src);
+// the value below which a fraction q of the samples falls (upper bound)
+uint64_t hist_quantile(const HistSum *h, double q);
+
+// Event loop counters
+struct IOStats
+{
+  Counter loops;     // event loop iterations
+  Counter events;    // ready fds / completions reported by the poller
+  Counter accepted;  // connections accepted so far
+  Counter conns;     // connections open now
+  Counter syscalls;  // socket and polling syscalls issued by the loop
+  Counter requests;
+  Counter bytes_in;
+  Counter bytes_out;
+
+  // the counters of every thread are registered for io_stats_total()
+  IOStats();
+  ~IOStats();
+  IOStats(const IOStats &) = delete;
+  IOStats &operator=(const IOStats &) = delete;
+};
+
+struct IOTotals
+{
+  uint64_t loops = 0;
+  uint64_t events = 0;
+  uint64_t accepted = 0;
+  uint64_t conns = 0;
+  uint64_t syscalls = 0;
+  uint64_t requests = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+};
+
+// per reactor thread
+extern thread_local IOStats g_io_stats;
+// the sum over all threads
+IOTotals io_stats_total();
+
+// Per-command counters, indexed by Command::id
+const size_t k_max_commands = 64;
+
+struct CmdStats
+{
+  Counter calls;
+  Counter arity_errors;
+  Histogram latency; // nanoseconds spent in the handler
+};
+
+struct CmdStatsTable
+{
+  CmdStats cmds[k_max_commands];
+
+  CmdStatsTable();
+  ~CmdStatsTable();
+  CmdStatsTable(const CmdStatsTable &) = delete;
+  CmdStatsTable &operator=(const CmdStatsTable &) = delete;
+};
+
+struct CmdTotals
+{
+  uint64_t calls = 0;
+  uint64_t arity_errors = 0;
+  HistSum latency;
+};
+
+extern thread_local CmdStatsTable g_cmd_stats;
+CmdTotals cmd_stats_total(uint32_t id);
+
+// Keyspace gauges of a shard, set by its thread from its DataStore (see
+// db_publish_stats()) so INFO on any thread can sum the shards
+struct DbStats
+{
+  Counter keys;
+  Counter buckets;
+  Counter rehash_buckets;
+  Counter rehash_pos;
+  Counter expires;
+  Counter used_memory;
+  Counter evicted;
+
+  DbStats();
+  ~DbStats();
+  DbStats(const DbStats &) = delete;
+  DbStats &operator=(const DbStats &) = delete;
+};
+
+struct DbTotals
+{
+  uint64_t keys = 0;
+  uint64_t buckets = 0;
+  uint64_t rehash_buckets = 0;
+  uint64_t rehash_pos = 0;
+  uint64_t expires = 0;
+  uint64_t used_memory = 0;
+  uint64_t evicted = 0;
+};
+
+extern thread_local DbStats g_db_stats;
+DbTotals db_stats_total();
+
+#endif // STATS_H
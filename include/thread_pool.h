@@ -0,0 +1,30 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Work
+{
+  void (*f)(void *) = nullptr;
+  void *arg = nullptr;
+};
+
+// Worker threads running jobs off the event loop, in the order queued.
+// The queue may be fed from any thread.
+struct ThreadPool
+{
+  std::vector<std::thread> threads;
+  std::deque<Work> queue;
+  std::mutex mu;
+  std::condition_variable not_empty;
+};
+
+void thread_pool_init(ThreadPool *tp, size_t num_threads);
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+
+#endif // THREAD_POOL_H
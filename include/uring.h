@@ -0,0 +1,72 @@
+#ifndef URING_H
+#define URING_H
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring driver on top of the raw syscalls: one SQ/CQ pair plus
+// a group (0) of provided buffers that recv requests pick from. Buffers are
+// handed back with IORING_OP_PROVIDE_BUFFERS, which rides along with the
+// next submission instead of costing a syscall of its own.
+class IoUring
+{
+public:
+  IoUring();
+  ~IoUring();
+  // false if the kernel lacks io_uring or any of the features the loop
+  // uses: provided buffers, multishot accept and CQE skipping (5.19)
+  bool init(unsigned entries, unsigned nbufs, unsigned buf_size);
+
+  // returns NULL when the submission queue is full
+  io_uring_sqe *get_sqe();
+  // submit everything queued and wait for at least wait_nr completions, or
+  // fail with ETIME after timeout_ms (< 0 waits forever). The timeout is
+  // ignored by kernels without IORING_FEAT_EXT_ARG.
+  int submit_and_wait(unsigned wait_nr, int timeout_ms = -1);
+
+  // the next completion; the driver's own completions are skipped
+  io_uring_cqe *peek_cqe();
+  void cqe_seen();
+
+  // provided buffers
+  uint8_t *buf_ptr(uint16_t bid) { return bufs + (size_t)bid * buf_size; }
+  void buf_recycle(uint16_t bid);
+  unsigned buf_len() const { return buf_size; }
+
+private:
+  int ring_fd = -1;
+  bool ext_arg = false;
+  // submission queue
+  void *sq_ptr = nullptr;
+  size_t sq_len = 0;
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  io_uring_sqe *sqes = nullptr;
+  size_t sqes_len = 0;
+  unsigned sqe_tail = 0; // local tail, published on submit
+  // completion queue
+  void *cq_ptr = nullptr;
+  size_t cq_len = 0;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+  // provided buffers
+  uint8_t *bufs = nullptr;
+  unsigned buf_size = 0;
+};
+
+#endif // HAVE_IO_URING
+
+#endif // URING_H
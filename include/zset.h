@@ -1,12 +1,14 @@
 #include "avl.h"
 #include "hashtable.h"
 #include <string>
+#include <string_view>
 #include <stdlib.h>
 
 struct ZSet
 {
   AVLNode *tree = nullptr;
   HMap hmap;
+  size_t mem = 0; // bytes of the nodes, for the memory accounting
 };
 
 struct ZNode
@@ -17,17 +19,19 @@ struct ZNode
   std::string name;
 };
 
-bool zset_add(ZSet *zset, const std::string &name, double score);
-ZNode *zset_lookup(ZSet *zset, const std::string &name);
-ZNode *zset_pop(ZSet *zset, const std::string &name);
-ZNode *zset_query(ZSet *zset, double score, const std::string &name);
+bool zset_add(ZSet *zset, std::string_view name, double score);
+ZNode *zset_lookup(ZSet *zset, std::string_view name);
+ZNode *zset_pop(ZSet *zset, std::string_view name);
+ZNode *zset_query(ZSet *zset, double score, std::string_view name);
 void zset_dispose(ZSet *zset);
 ZNode *znode_offset(ZNode *node, int64_t offset);
 void znode_del(ZNode *node);
+// bytes of the zset, its nodes and its hashtable
+size_t zset_mem(ZSet *zset);
 
 // a helper structure for the hashtable lookup
 struct HKey
 {
   HNode node;
-  std::string name;
+  std::string_view name;
 };
\ No newline at end of file
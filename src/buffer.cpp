@@ -0,0 +1,128 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "buffer.h"
+#include "common.h"
+
+const size_t k_min_block = 4096;
+const size_t k_num_classes = 48;
+// blocks above this size go straight back to malloc
+const size_t k_max_pooled_block = 1 << 20;
+// upper bound of the memory the pool keeps around
+const size_t k_max_pool_bytes = 32 << 20;
+
+struct BufPool
+{
+    std::vector<uint8_t *> free_blocks[k_num_classes];
+    size_t cached = 0;
+
+    ~BufPool()
+    {
+        for (std::vector<uint8_t *> &list : free_blocks)
+        {
+            for (uint8_t *block : list)
+            {
+                free(block);
+            }
+        }
+    }
+};
+
+// one pool per thread, a block may be released by another thread than
+// the one that allocated it
+static thread_local BufPool g_pool;
+
+static size_t block_class(size_t n)
+{
+    size_t cls = 0;
+    while ((k_min_block << cls) < n)
+    {
+        cls++;
+    }
+    assert(cls < k_num_classes);
+    return cls;
+}
+
+static uint8_t *block_get(size_t cls)
+{
+    std::vector<uint8_t *> &list = g_pool.free_blocks[cls];
+    if (!list.empty())
+    {
+        uint8_t *block = list.back();
+        list.pop_back();
+        g_pool.cached -= k_min_block << cls;
+        return block;
+    }
+    uint8_t *block = (uint8_t *)malloc(k_min_block << cls);
+    if (!block)
+    {
+        die("out of memory");
+    }
+    return block;
+}
+
+static void block_put(uint8_t *block, size_t cap)
+{
+    size_t cls = block_class(cap);
+    if (cap > k_max_pooled_block || g_pool.cached + cap > k_max_pool_bytes)
+    {
+        free(block);
+        return;
+    }
+    g_pool.free_blocks[cls].push_back(block);
+    g_pool.cached += cap;
+}
+
+void buf_reserve(Buffer *buf, size_t n)
+{
+    size_t need = buf->size + n;
+    if (need <= buf->cap)
+    {
+        return;
+    }
+    size_t cls = block_class(need);
+    uint8_t *block = block_get(cls);
+    if (buf->size)
+    {
+        memcpy(block, buf->data, buf->size);
+    }
+    if (buf->data)
+    {
+        block_put(buf->data, buf->cap);
+    }
+    buf->data = block;
+    buf->cap = k_min_block << cls;
+}
+
+void buf_append(Buffer *buf, const void *data, size_t n)
+{
+    buf_reserve(buf, n);
+    memcpy(&buf->data[buf->size], data, n);
+    buf->size += n;
+}
+
+void buf_consume(Buffer *buf, size_t n)
+{
+    assert(n <= buf->size);
+    size_t remain = buf->size - n;
+    if (remain && n)
+    {
+        memmove(buf->data, &buf->data[n], remain);
+    }
+    buf->size = remain;
+}
+
+void buf_release(Buffer *buf)
+{
+    if (buf->data)
+    {
+        block_put(buf->data, buf->cap);
+    }
+    *buf = Buffer{};
+}
+
+size_t buf_pool_cached()
+{
+    return g_pool.cached;
+}
@@ -1,60 +1,248 @@
 #include "commands.h"
 #include "datastore.h"
 #include "common.h"
+#include "protocol.h"
+#include "shard.h"
+#include "slowlog.h"
+#include "stats.h"
+#include <cctype>
 #include <cstring>
 #include <cassert>
 #include <cstdint>
 
 // Implement command handling functions
 
-static bool cmd_is(const std::string &word, const char *cmd)
+// case-insensitive compare; the word is not NUL-terminated
+bool cmd_is(std::string_view word, const char *cmd)
 {
-  return _stricmp(word.c_str(), cmd) == 0;
+  size_t n = strlen(cmd);
+  if (word.size() != n)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (tolower((unsigned char)word[i]) != cmd[i])
+    {
+      return false;
+    }
+  }
+  return true;
 }
 
-void do_request(std::vector<std::string> &cmd, std::string &out)
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out);
+
+// the command table; new commands only need an entry here
+static const Command k_commands[] = {
+    {"get", &do_get, 2, CMD_READ, ROUTE_KEY, 0},
+    {"set", &do_set, 3, CMD_WRITE | CMD_GROW, ROUTE_KEY, 1},
+    {"del", &do_del, -2, CMD_WRITE, ROUTE_MULTI, 2},
+    {"unlink", &do_del, -2, CMD_WRITE, ROUTE_MULTI, 3},
+    {"keys", &do_keys, 1, CMD_READ | CMD_SLOW, ROUTE_ALL, 4},
+    {"zadd", &do_zadd, 4, CMD_WRITE | CMD_GROW, ROUTE_KEY, 5},
+    {"zrem", &do_zrem, 3, CMD_WRITE, ROUTE_KEY, 6},
+    {"zscore", &do_zscore, 3, CMD_READ, ROUTE_KEY, 7},
+    {"zquery", &do_zquery, 6, CMD_READ | CMD_SLOW, ROUTE_KEY, 8},
+    {"info", &do_info, -1, CMD_READ, ROUTE_LOCAL, 9},
+    {"slowlog", &do_slowlog, -2, CMD_READ, ROUTE_LOCAL, 10},
+    {"mget", &do_mget, -2, CMD_READ, ROUTE_MULTI, 11},
+    {"mset", &do_mset, -3, CMD_WRITE | CMD_GROW, ROUTE_MULTI, 12, 2},
+    {"scan", &do_scan, -2, CMD_READ, ROUTE_CURSOR, 13},
+    {"incr", &do_incr, 2, CMD_WRITE | CMD_GROW, ROUTE_KEY, 14},
+    {"decr", &do_incr, 2, CMD_WRITE | CMD_GROW, ROUTE_KEY, 15},
+    {"incrby", &do_incr, 3, CMD_WRITE | CMD_GROW, ROUTE_KEY, 16},
+    {"incrbyfloat", &do_incrbyfloat, 3, CMD_WRITE | CMD_GROW, ROUTE_KEY, 17},
+    {"expire", &do_expire, 3, CMD_WRITE, ROUTE_KEY, 18},
+    {"pexpire", &do_expire, 3, CMD_WRITE, ROUTE_KEY, 19},
+    {"ttl", &do_ttl, 2, CMD_READ, ROUTE_KEY, 20},
+    {"pttl", &do_ttl, 2, CMD_READ, ROUTE_KEY, 21},
+    {"memory", &do_memory, 3, CMD_READ, ROUTE_SUBKEY, 22},
+    {"bigkeys", &do_bigkeys, -2, CMD_READ, ROUTE_CURSOR, 23},
+    {"hset", &do_hset, -4, CMD_WRITE | CMD_GROW, ROUTE_KEY, 24},
+    {"hget", &do_hget, 3, CMD_READ, ROUTE_KEY, 25},
+    {"hdel", &do_hdel, -3, CMD_WRITE, ROUTE_KEY, 26},
+    {"hgetall", &do_hgetall, 2, CMD_READ | CMD_SLOW, ROUTE_KEY, 27},
+    {"hincrby", &do_hincrby, 4, CMD_WRITE | CMD_GROW, ROUTE_KEY, 28},
+    {"lpush", &do_push, -3, CMD_WRITE | CMD_GROW, ROUTE_KEY, 29},
+    {"rpush", &do_push, -3, CMD_WRITE | CMD_GROW, ROUTE_KEY, 30},
+    {"lpop", &do_pop, 2, CMD_WRITE, ROUTE_KEY, 31},
+    {"rpop", &do_pop, 2, CMD_WRITE, ROUTE_KEY, 32},
+    {"lrange", &do_lrange, 4, CMD_READ | CMD_SLOW, ROUTE_KEY, 33},
+    {"llen", &do_llen, 2, CMD_READ, ROUTE_KEY, 34},
+};
+
+const size_t k_num_commands = sizeof(k_commands) / sizeof(k_commands[0]);
+// longer names can not be commands
+const size_t k_max_cmd_len = 16;
+
+static_assert(k_num_commands <= k_max_commands, "raise k_max_commands");
+
+// the table bucketed by name length, so a lookup compares a handful of names
+struct CmdIndex
 {
-  if (cmd.empty())
+  std::vector<const Command *> by_len[k_max_cmd_len + 1];
+
+  CmdIndex()
   {
-    out_err(out, ERR_ARG, "Empty command");
-    return;
+    for (size_t i = 0; i < k_num_commands; ++i)
+    {
+      const Command *c = &k_commands[i];
+      assert(c->id == i && strlen(c->name) <= k_max_cmd_len);
+      by_len[strlen(c->name)].push_back(c);
+    }
   }
+};
+
+static const CmdIndex g_cmd_index;
+
+const Command *cmd_lookup(std::string_view name)
+{
+  if (name.size() > k_max_cmd_len)
+  {
+    return NULL;
+  }
+  for (const Command *c : g_cmd_index.by_len[name.size()])
+  {
+    if (cmd_is(name, c->name))
+    {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+const Command *cmd_table(size_t *n)
+{
+  *n = k_num_commands;
+  return k_commands;
+}
+
+static bool arity_ok(const Command *c, size_t argc)
+{
+  return c->arity >= 0 ? argc == (size_t)c->arity : argc >= (size_t)-c->arity;
+}
 
-  if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+CmdRoute cmd_route(const std::vector<std::string_view> &cmd)
+{
+  const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+  if (!c || !arity_ok(c, cmd.size()) ||
+      (c->route == ROUTE_MULTI && (cmd.size() - 1) % c->key_step != 0))
   {
-    do_keys(cmd, out);
+    // the error is returned by the shard that received it
+    return ROUTE_LOCAL;
   }
-  else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+  return c->route;
+}
+
+void do_request(std::vector<std::string_view> &cmd, Buffer &out, SOCKET client)
+{
+  if (cmd.empty())
   {
-    do_get(cmd, out);
+    out_err(out, ERR_ARG, "Empty command");
+    return;
   }
-  else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+
+  const Command *c = cmd_lookup(cmd[0]);
+  if (!c)
   {
-    do_set(cmd, out);
+    // cmd is not recognized
+    out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    return;
   }
-  else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+  CmdStats &stats = g_cmd_stats.cmds[c->id];
+  if (!arity_ok(c, cmd.size()))
   {
-    do_del(cmd, out);
+    stats.arity_errors++;
+    out_err(out, ERR_ARG, "wrong number of arguments");
+    return;
   }
-  else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd"))
+  if ((c->flags & CMD_GROW) && !db_evict())
   {
-    do_zadd(cmd, out);
+    out_err(out, ERR_OOM, "command not allowed when used memory > maxmemory");
+    return;
   }
-  else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+  stats.calls++;
+  uint64_t start = get_monotonic_nsec();
+  c->handler(cmd, out);
+  uint64_t elapsed = get_monotonic_nsec() - start;
+  hist_record(&stats.latency, elapsed);
+  slowlog_record(cmd, elapsed / 1000, client);
+}
+
+static void out_stat(Buffer &out, std::string_view name, uint64_t val)
+{
+  out_str(out, name);
+  out_int(out, (int64_t)val);
+}
+
+// INFO [section]: a flat array of name, value pairs. The sections are
+// "server", "commands" and "keyspace", each summed over the threads; the
+// other shards' keyspace figures are as of their last event loop round.
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  std::string_view section = cmd.size() > 1 ? cmd[1] : "";
+  bool all = section.empty();
+  if (cmd.size() > 2 || !(all || cmd_is(section, "server") ||
+                          cmd_is(section, "commands") || cmd_is(section, "keyspace")))
   {
-    do_zrem(cmd, out);
+    return out_err(out, ERR_ARG, "expect INFO [server|commands|keyspace]");
   }
-  else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+  size_t arr = begin_arr(out);
+  uint32_t n = 0;
+
+  if (all || cmd_is(section, "server"))
   {
-    do_zscore(cmd, out);
+    IOTotals io = io_stats_total();
+    out_stat(out, "threads", shard_count());
+    out_stat(out, "connections", io.conns);
+    out_stat(out, "accepted", io.accepted);
+    out_stat(out, "loops", io.loops);
+    out_stat(out, "events", io.events);
+    out_stat(out, "syscalls", io.syscalls);
+    out_stat(out, "requests", io.requests);
+    out_stat(out, "bytes_in", io.bytes_in);
+    out_stat(out, "bytes_out", io.bytes_out);
+    n += 9;
   }
-  else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+
+  if (all || cmd_is(section, "commands"))
   {
-    do_zquery(cmd, out);
+    std::string name;
+    for (size_t i = 0; i < k_num_commands; ++i)
+    {
+      CmdTotals t = cmd_stats_total(k_commands[i].id);
+      if (t.calls == 0 && t.arity_errors == 0)
+      {
+        continue;
+      }
+      name = std::string("cmd.") + k_commands[i].name + ".";
+      const HistSum &lat = t.latency;
+      out_stat(out, name + "calls", t.calls);
+      out_stat(out, name + "arity_errors", t.arity_errors);
+      out_stat(out, name + "usec", lat.sum / 1000);
+      out_stat(out, name + "p50_ns", hist_quantile(&lat, 0.5));
+      out_stat(out, name + "p99_ns", hist_quantile(&lat, 0.99));
+      out_stat(out, name + "p999_ns", hist_quantile(&lat, 0.999));
+      out_stat(out, name + "max_ns", lat.max);
+      n += 7;
+    }
   }
-  else
+
+  if (all || cmd_is(section, "keyspace"))
   {
-    // cmd is not recognized
-    out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    db_publish_stats(); // this shard's figures are exact
+    DbTotals db = db_stats_total();
+    out_stat(out, "db.keys", db.keys);
+    out_stat(out, "db.buckets", db.buckets);
+    // the older tables still being moved into the new ones, 0 if not resizing
+    out_stat(out, "db.rehash_buckets", db.rehash_buckets);
+    out_stat(out, "db.rehash_pos", db.rehash_pos);
+    out_str(out, "db.load_factor");
+    out_dbl(out, db.buckets ? (double)db.keys / (double)db.buckets : 0);
+    out_stat(out, "db.expires", db.expires);
+    out_stat(out, "db.used_memory", db.used_memory);
+    out_stat(out, "db.evicted", db.evicted);
+    n += 8;
   }
+  end_arr(out, arr, n * 2);
 }
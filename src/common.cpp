@@ -1,9 +1,22 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
-#include <winsock2.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <chrono>
+#include <random>
 #include "common.h"
 
+static uint64_t hash_seed_random()
+{
+  std::random_device rd;
+  uint64_t seed = ((uint64_t)rd() << 32) ^ rd();
+  // premixed once here instead of on every call
+  return seed ^ hash_mix(seed ^ k_hash_s0, k_hash_s1);
+}
+
+uint64_t g_hash_seed = hash_seed_random();
+
 void msg(const char *message)
 {
   fprintf(stderr, "%s\n", message);
@@ -11,17 +24,85 @@ void msg(const char *message)
 
 void die(const char *message)
 {
-  int err = WSAGetLastError();
+  int err = net_errno();
   fprintf(stderr, "[%d] %s\n", err, message);
   abort();
 }
 
+uint64_t get_monotonic_usec()
+{
+  return get_monotonic_nsec() / 1000;
+}
+
+uint64_t get_monotonic_nsec()
+{
+  using namespace std::chrono;
+  return (uint64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 void fd_set_nb(SOCKET fd)
 {
+#ifdef _WIN32
   u_long mode = 1;
   int result = ioctlsocket(fd, FIONBIO, &mode);
   if (result != NO_ERROR)
   {
     die("ioctlsocket error");
   }
+#else
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    die("fcntl error");
+  }
+#endif
+}
+
+void net_init()
+{
+#ifdef _WIN32
+  WSADATA wsaData;
+  int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+  if (iResult != 0)
+  {
+    die("WSAStartup failed");
+  }
+#else
+  // a peer closing its end must not kill the server through SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+void net_cleanup()
+{
+#ifdef _WIN32
+  WSACleanup();
+#endif
+}
+
+int net_errno()
+{
+#ifdef _WIN32
+  return WSAGetLastError();
+#else
+  return errno;
+#endif
+}
+
+bool net_would_block(int err)
+{
+#ifdef _WIN32
+  return err == WSAEWOULDBLOCK;
+#else
+  return err == EAGAIN || err == EWOULDBLOCK;
+#endif
+}
+
+bool net_interrupted(int err)
+{
+#ifdef _WIN32
+  return err == WSAEINTR;
+#else
+  return err == EINTR;
+#endif
 }
@@ -1,10 +1,25 @@
 #include "connection.h"
+#include "datastore.h"
 #include "protocol.h"
+#include "shard.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 
+uint64_t g_idle_timeout_ms = 300 * 1000;
+
+static void conn_free(Conn *conn)
+{
+  g_io_stats.conns -= 1;
+  dlist_detach(&conn->idle_list);
+  buf_release(&conn->rbuf);
+  buf_release(&conn->wbuf);
+  shard_parts_free(conn);
+  delete conn;
+}
+
 // Implement ConnectionManager methods
 
 ConnectionManager::ConnectionManager() : listen_fd(INVALID_SOCKET) {}
@@ -16,24 +31,19 @@ ConnectionManager::~ConnectionManager()
     if (conn)
     {
       closesocket(conn->fd);
-      free(conn);
+      conn_free(conn);
     }
   }
   if (listen_fd != INVALID_SOCKET)
   {
     closesocket(listen_fd);
   }
-  WSACleanup();
+  net_cleanup();
 }
 
-void ConnectionManager::initialize()
+void ConnectionManager::initialize(uint16_t port)
 {
-  WSADATA wsaData;
-  int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-  if (iResult != 0)
-  {
-    die("WSAStartup failed");
-  }
+  net_init();
 
   listen_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_fd == INVALID_SOCKET)
@@ -43,11 +53,18 @@ void ConnectionManager::initialize()
 
   int val = 1;
   setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&val, sizeof(val));
+#ifdef SO_REUSEPORT
+  if (shard_count() > 1)
+  {
+    // every reactor listens on the same port, the kernel spreads the clients
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&val, sizeof(val));
+  }
+#endif
 
   // bind
   struct sockaddr_in addr = {};
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(1234);
+  addr.sin_port = htons(port);
   addr.sin_addr.s_addr = htonl(INADDR_ANY); // wildcard address 0.0.0.0
   int rv = bind(listen_fd, (const sockaddr *)&addr, sizeof(addr));
   if (rv == SOCKET_ERROR)
@@ -64,95 +81,203 @@ void ConnectionManager::initialize()
 
   // set the listen fd to nonblocking mode
   fd_set_nb(listen_fd);
+  poller.add(listen_fd, POLL_IN);
+  if (shard_wake_fd() != INVALID_SOCKET)
+  {
+    poller.add(shard_wake_fd(), POLL_IN);
+  }
 }
 
-void ConnectionManager::run()
+// the readiness a connection waits for in each state
+static uint32_t conn_interest(const Conn *conn)
 {
-  fd_set read_fds, write_fds, except_fds;
-  int max_fd = listen_fd;
+  return conn->state == STATE_REQ ? POLL_IN : POLL_OUT;
+}
 
+void ConnectionManager::run()
+{
+  std::vector<PollEvent> events;
+  bool backlog = false;
+  bool db_busy = false;
   while (true)
   {
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-    FD_ZERO(&except_fds);
-
-    FD_SET(listen_fd, &read_fds);
-    FD_SET(listen_fd, &except_fds);
-
-    for (Conn *conn : fd2conn)
+    // only the connections that became ready are visited;
+    // messages stuck behind a full shard queue are retried shortly,
+    // and pending expiry or rehash work turns the wait into a poll
+    int timeout_ms = next_timer_ms();
+    if (db_busy)
     {
-      if (!conn)
+      timeout_ms = 0;
+    }
+    else if (backlog && timeout_ms != 0)
+    {
+      timeout_ms = 1;
+    }
+    poller.wait(events, timeout_ms);
+    g_io_stats.loops++;
+    g_io_stats.events += events.size();
+    for (const PollEvent &ev : events)
+    {
+      if (ev.fd == shard_wake_fd())
+      {
+        handle_shard_msgs();
+        continue;
+      }
+      if (ev.fd == listen_fd)
+      {
+        while (accept_new_conn())
+        {
+          // drain the accept queue
+        }
         continue;
-      if (conn->state == STATE_REQ)
+      }
+
+      Conn *conn = (size_t)ev.fd < fd2conn.size() ? fd2conn[ev.fd] : nullptr;
+      if (!conn)
       {
-        FD_SET(conn->fd, &read_fds);
+        continue;
       }
-      else if (conn->state == STATE_RES)
+      conn_touch(conn);
+      uint32_t old_state = conn->state;
+      handle_connection_io(conn);
+      if (conn->state == STATE_END)
       {
-        FD_SET(conn->fd, &write_fds);
+        cleanup_connection(conn);
       }
-      FD_SET(conn->fd, &except_fds);
-      if (conn->fd > max_fd)
+      else if (conn->state != old_state)
       {
-        max_fd = conn->fd;
+        poller.mod(conn->fd, conn_interest(conn));
       }
     }
+    while (Conn *conn = pop_expired())
+    {
+      msg("removing idle connection");
+      cleanup_connection(conn);
+    }
+    backlog = shard_count() > 1 && shard_flush();
+    // expired keys go every round, the db is rehashed in the background
+    // only when there was nothing else to do
+    bool expiring = db_expire(k_expire_usec);
+    db_busy = db_rehash(events.empty() ? k_idle_rehash_usec : 0) || expiring;
+    db_publish_stats();
+  }
+}
+
+// mark activity: the connection moves to the back of the idle list
+void ConnectionManager::conn_touch(Conn *conn)
+{
+  conn->idle_start = get_monotonic_usec() / 1000;
+  dlist_detach(&conn->idle_list);
+  dlist_insert_before(&idle_list, &conn->idle_list);
+}
+
+// poll timeout until the oldest connection or the next key expires,
+// -1 if there is neither
+int ConnectionManager::next_timer_ms()
+{
+  int timeout_ms = db_next_timer_ms();
+  if (g_idle_timeout_ms == 0 || dlist_empty(&idle_list))
+  {
+    return timeout_ms;
+  }
+  uint64_t now_ms = get_monotonic_usec() / 1000;
+  Conn *next = container_of(idle_list.next, Conn, idle_list);
+  uint64_t next_ms = next->idle_start + g_idle_timeout_ms;
+  if (next_ms <= now_ms)
+  {
+    return 0; // already expired
+  }
+  int idle_ms = (int)(next_ms - now_ms);
+  return timeout_ms < 0 ? idle_ms : std::min(timeout_ms, idle_ms);
+}
 
-    int rv = select(max_fd + 1, &read_fds, &write_fds, &except_fds, NULL);
-    if (rv == SOCKET_ERROR)
+// requests from other shards and replies to the ones we forwarded
+void ConnectionManager::handle_shard_msgs()
+{
+  shard_wake_ack();
+  while (ShardMsg *msg = shard_recv())
+  {
+    if (!msg->is_reply)
     {
-      die("select");
+      shard_execute(msg);
+      continue;
     }
 
-    if (FD_ISSET(listen_fd, &read_fds))
+    Conn *conn = msg->conn;
+    bool done = shard_merge_reply(conn, msg);
+    if (!done)
+    {
+      continue;
+    }
+    if (conn->state == STATE_END)
     {
-      accept_new_conn();
+      // closed while waiting, see cleanup_connection()
+      conn_free(conn);
+      continue;
     }
+    resume_conn(conn);
+  }
+}
 
-    for (Conn *conn : fd2conn)
+// a forwarded request has its reply queued: continue the pipeline
+void ConnectionManager::resume_conn(Conn *conn)
+{
+  uint32_t old_state = conn->state;
+  if (conn->state == STATE_REQ)
+  {
+    conn->state = STATE_RES;
+    state_res(conn);
+    if (conn->state == STATE_REQ && try_requests(conn))
     {
-      if (!conn)
-        continue;
-      if (FD_ISSET(conn->fd, &read_fds) ||
-          FD_ISSET(conn->fd, &write_fds) ||
-          FD_ISSET(conn->fd, &except_fds))
-      {
-        handle_connection_io(conn);
-        if (conn->state == STATE_END)
-        {
-          cleanup_connection(conn);
-        }
-      }
+      // the socket may hold data whose readiness edge we have consumed
+      state_req(conn);
     }
   }
+  if (conn->state == STATE_END)
+  {
+    cleanup_connection(conn);
+  }
+  else if (conn->state != old_state)
+  {
+    poller.mod(conn->fd, conn_interest(conn));
+  }
 }
 
-void ConnectionManager::accept_new_conn()
+bool ConnectionManager::accept_new_conn()
 {
   struct sockaddr_in client_addr = {};
-  int socklen = sizeof(client_addr);
+  socklen_t socklen = sizeof(client_addr);
   SOCKET connfd = accept(listen_fd, (struct sockaddr *)&client_addr, &socklen);
   if (connfd == INVALID_SOCKET)
   {
-    msg("accept() error");
-    return;
+    int err = net_errno();
+    if (!net_would_block(err) && !net_interrupted(err))
+    {
+      msg("accept() error");
+    }
+    return false;
   }
 
+  g_io_stats.syscalls++;
+
   // set the new connection fd to nonblocking mode
   fd_set_nb(connfd);
-  // creating the struct Conn
-  Conn *conn = (Conn *)malloc(sizeof(Conn));
-  if (!conn)
+  Conn *conn = register_conn(connfd);
+  if (conn)
   {
-    closesocket(connfd);
-    return;
+    poller.add(conn->fd, conn_interest(conn));
   }
+  return true;
+}
+
+Conn *ConnectionManager::register_conn(SOCKET connfd)
+{
+  // creating the struct Conn
+  Conn *conn = new Conn();
   conn->fd = connfd;
+  g_io_stats.accepted++;
+  g_io_stats.conns++;
   conn->state = STATE_REQ;
-  conn->rbuf_size = 0;
-  conn->wbuf_size = 0;
-  conn->wbuf_sent = 0;
 
   // Ensure fd2conn can hold the new fd
   if (fd2conn.size() <= (size_t)conn->fd)
@@ -160,6 +285,8 @@ void ConnectionManager::accept_new_conn()
     fd2conn.resize(conn->fd + 1, nullptr);
   }
   fd2conn[conn->fd] = conn;
+  conn_touch(conn);
+  return conn;
 }
 
 void ConnectionManager::handle_connection_io(Conn *conn)
@@ -171,12 +298,303 @@ void ConnectionManager::handle_connection_io(Conn *conn)
   else if (conn->state == STATE_RES)
   {
     state_res(conn);
+    if (conn->state == STATE_REQ)
+    {
+      // requests that arrived while we were flushing are already buffered,
+      // and an edge-triggered poller will not report them again
+      if (try_requests(conn))
+      {
+        state_req(conn);
+      }
+    }
   }
 }
 
 void ConnectionManager::cleanup_connection(Conn *conn)
 {
+  dlist_detach(&conn->idle_list);
   fd2conn[conn->fd] = nullptr;
+  poller.del(conn->fd);
   closesocket(conn->fd);
-  free(conn);
+  if (conn->shard_wait)
+  {
+    // another shard still holds a pointer to it, freed once the reply is in
+    conn->state = STATE_END;
+    return;
+  }
+  conn_free(conn);
+}
+
+// the next connection that has been idle for too long, taken off the idle
+// list; the list is ordered by last activity so only expired ones are visited
+Conn *ConnectionManager::pop_expired()
+{
+  if (g_idle_timeout_ms == 0 || dlist_empty(&idle_list))
+  {
+    return nullptr;
+  }
+  uint64_t now_ms = get_monotonic_usec() / 1000;
+  Conn *next = container_of(idle_list.next, Conn, idle_list);
+  if (next->idle_start + g_idle_timeout_ms > now_ms)
+  {
+    return nullptr; // not expired
+  }
+  dlist_detach(&next->idle_list);
+  return next;
+}
+
+#ifdef HAVE_IO_URING
+
+// operation tags, kept in the low bits of the (aligned) Conn pointer
+enum
+{
+  URING_ACCEPT = 0,
+  URING_RECV = 1,
+  URING_SEND = 2,
+};
+
+const unsigned k_uring_entries = 1024;
+const unsigned k_uring_nbufs = 1024;
+const unsigned k_uring_buf_size = 4096;
+// wait before accepting again when out of fds or memory
+const uint64_t k_accept_backoff_ms = 100;
+
+static io_uring_sqe *uring_sqe(IoUring &ring)
+{
+  io_uring_sqe *sqe = ring.get_sqe();
+  if (!sqe)
+  {
+    // the queue is full, push it to the kernel without waiting
+    ring.submit_and_wait(0);
+    sqe = ring.get_sqe();
+  }
+  return sqe;
+}
+
+static void uring_arm_accept(IoUring &ring, SOCKET listen_fd)
+{
+  io_uring_sqe *sqe = uring_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_ACCEPT;
+}
+
+// queue whatever I/O the connection can make progress with
+static void uring_advance(IoUring &ring, Conn *conn)
+{
+  if (conn->state == STATE_REQ && process_requests(conn))
+  {
+    conn->state = STATE_RES;
+  }
+  if (conn->state == STATE_END)
+  {
+    return;
+  }
+  if (conn->state == STATE_RES && !(conn->io_ops & URING_SEND))
+  {
+    io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->wbuf.data[conn->wbuf_sent];
+    sqe->len = (uint32_t)(conn->wbuf.size - conn->wbuf_sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_SEND;
+    conn->io_ops |= URING_SEND;
+  }
+  // keep reading ahead while there is room, even when a reply is in flight
+  if (conn->rbuf.size < 4 + g_max_msg && !(conn->io_ops & URING_RECV))
+  {
+    io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = ring.buf_len();
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_RECV;
+    conn->io_ops |= URING_RECV;
+  }
+}
+
+static void uring_on_recv(IoUring &ring, Conn *conn, io_uring_cqe *cqe)
+{
+  conn->io_ops &= ~URING_RECV;
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+  {
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe->res > 0 && conn->state != STATE_END)
+    {
+      buf_append(&conn->rbuf, ring.buf_ptr(bid), (size_t)cqe->res);
+      g_io_stats.bytes_in += (size_t)cqe->res;
+    }
+    ring.buf_recycle(bid);
+  }
+  if (cqe->res == 0)
+  {
+    msg(conn->rbuf.size > 0 ? "unexpected EOF" : "EOF");
+    conn->state = STATE_END;
+  }
+  else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+  {
+    // -ENOBUFS: every provided buffer was busy, the recv is simply re-armed
+    msg("recv() error");
+    conn->state = STATE_END;
+  }
+}
+
+static void uring_on_send(Conn *conn, io_uring_cqe *cqe)
+{
+  conn->io_ops &= ~URING_SEND;
+  if (cqe->res < 0)
+  {
+    if (conn->state != STATE_END)
+    {
+      msg("send() error");
+    }
+    conn->state = STATE_END;
+    return;
+  }
+  conn->wbuf_sent += (size_t)cqe->res;
+  g_io_stats.bytes_out += (size_t)cqe->res;
+  assert(conn->wbuf_sent <= conn->wbuf.size);
+  if (conn->wbuf_sent == conn->wbuf.size && conn->state == STATE_RES)
+  {
+    // responses were fully sent, change state back
+    conn->state = STATE_REQ;
+    conn->wbuf_sent = 0;
+    buf_release(&conn->wbuf);
+  }
+}
+
+bool ConnectionManager::run_uring()
+{
+  IoUring ring;
+  if (!ring.init(k_uring_entries, k_uring_nbufs, k_uring_buf_size))
+  {
+    return false;
+  }
+  uring_arm_accept(ring, listen_fd);
+
+  std::vector<Conn *> touched;
+  bool db_busy = false;
+  uint64_t accept_retry_ms = 0; // when to re-arm a failed accept, 0 if armed
+  while (true)
+  {
+    int timeout_ms = next_timer_ms();
+    if (accept_retry_ms)
+    {
+      uint64_t now_ms = get_monotonic_usec() / 1000;
+      if (accept_retry_ms <= now_ms)
+      {
+        uring_arm_accept(ring, listen_fd);
+        accept_retry_ms = 0;
+      }
+      else
+      {
+        int retry_ms = (int)(accept_retry_ms - now_ms);
+        timeout_ms = timeout_ms < 0 ? retry_ms : std::min(timeout_ms, retry_ms);
+      }
+    }
+    // one io_uring_enter submits the I/O of the previous iteration
+    // and waits for the next completions, unless db work is pending
+    if (ring.submit_and_wait(db_busy ? 0 : 1, timeout_ms) < 0 &&
+        errno != EBUSY && errno != ETIME)
+    {
+      die("io_uring_enter()");
+    }
+
+    g_io_stats.loops++;
+    touched.clear();
+    while (io_uring_cqe *cqe = ring.peek_cqe())
+    {
+      g_io_stats.events++;
+      uint32_t op = (uint32_t)(cqe->user_data & 3);
+      Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+      if (op == URING_ACCEPT)
+      {
+        int err = cqe->res < 0 ? -cqe->res : 0;
+        if (!err)
+        {
+          conn = register_conn(cqe->res);
+        }
+        bool armed = cqe->flags & IORING_CQE_F_MORE;
+        if (!armed && (!err || err == ECONNABORTED || err == EINTR || err == EAGAIN))
+        {
+          uring_arm_accept(ring, listen_fd);
+        }
+        else if (!armed && (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM))
+        {
+          // re-arming now would fail again at once
+          msg("accept() error, backing off");
+          accept_retry_ms = get_monotonic_usec() / 1000 + k_accept_backoff_ms;
+        }
+        else if (!armed)
+        {
+          // e.g. EINVAL: re-arming would spin on the same error
+          msg("io_uring accept failed, no longer accepting connections");
+        }
+      }
+      else if (op == URING_RECV)
+      {
+        uring_on_recv(ring, conn, cqe);
+      }
+      else
+      {
+        uring_on_send(conn, cqe);
+      }
+      ring.cqe_seen();
+      if (conn)
+      {
+        touched.push_back(conn);
+      }
+    }
+
+    for (Conn *conn : touched)
+    {
+      conn_touch(conn);
+    }
+    while (Conn *conn = pop_expired())
+    {
+      msg("removing idle connection");
+      conn->state = STATE_END;
+      touched.push_back(conn);
+    }
+
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for (Conn *conn : touched)
+    {
+      if (conn->state != STATE_END)
+      {
+        uring_advance(ring, conn);
+      }
+      if (conn->state != STATE_END)
+      {
+        continue;
+      }
+      if (conn->io_ops == 0)
+      {
+        fd2conn[conn->fd] = nullptr;
+        closesocket(conn->fd);
+        conn_free(conn);
+      }
+      else
+      {
+        // force the in-flight operations to complete so the Conn can go
+        shutdown(conn->fd, SHUT_RDWR);
+      }
+    }
+    bool expiring = db_expire(k_expire_usec);
+    db_busy = db_rehash(touched.empty() ? k_idle_rehash_usec : 0) || expiring;
+    db_publish_stats();
+  }
+}
+
+#else
+
+bool ConnectionManager::run_uring()
+{
+  return false;
 }
+
+#endif // HAVE_IO_URING
@@ -1,6 +1,14 @@
 #include "datastore.h"
 #include "common.h"
+#include "commands.h"
+#include "shard.h"
+#include "thread_pool.h"
+#include "stats.h"
 #include <math.h>
+#include <random>
+#include <charconv>
+#include <new>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <cstring>
@@ -9,143 +17,1158 @@
 #include <cstdint>
 #include <iostream>
 // Initialize the global data store
-DataStore g_data;
+thread_local DataStore g_data;
 
 // Implement command functions
 
-static bool entry_eq(HNode *lhs, HNode *rhs)
+// a search key that views the request, so no key is copied just to look it up
+struct LookupKey
 {
-  struct Entry *le = container_of(lhs, struct Entry, node);
-  struct Entry *re = container_of(rhs, struct Entry, node);
-  return le->key == re->key;
+  HNode node;
+  std::string_view key;
+};
+
+static void lookup_key_init(LookupKey *lk, std::string_view key)
+{
+  lk->key = key;
+  lk->node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+}
+
+static bool entry_eq(HNode *node, HNode *key)
+{
+  struct Entry *ent = container_of(node, struct Entry, node);
+  LookupKey *lk = container_of(key, LookupKey, node);
+  return entry_key(ent) == lk->key;
+}
+
+// nodes moved between two clock reads
+const size_t k_rehash_step = 1024;
+
+bool db_rehash(uint64_t budget_usec)
+{
+  uint64_t start = get_monotonic_usec();
+  while (hm_rehash(&g_data.db, budget_usec ? k_rehash_step : 0))
+  {
+    if (get_monotonic_usec() - start >= budget_usec)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// values above these sizes are freed by a background thread
+const size_t k_large_container_size = 1000;
+const size_t k_large_str_size = 64 * 1024;
+
+size_t g_maxmemory = 0;
+std::uint32_t g_evict_policy = EVICT_NONE;
+
+// the clock of the expiry times and of the access times
+static uint64_t now_ms()
+{
+  return get_monotonic_usec() / 1000;
+}
+
+const uint32_t k_access_mask = (1u << 20) - 1;
+const uint32_t k_lfu_init = 5; // so a new key is not the first to go
+const uint32_t k_lfu_log_factor = 10;
+
+static uint32_t lru_clock()
+{
+  return (uint32_t)(now_ms() / 1000) & k_access_mask;
+}
+
+static uint32_t lfu_minutes()
+{
+  return (uint32_t)(now_ms() / 60000) & (k_access_mask >> 8);
+}
+
+// the LFU counter after losing 1 per minute since it was last touched
+static uint32_t lfu_counter(const Entry *ent)
+{
+  uint32_t counter = ent->access & 0xFF;
+  uint32_t elapsed = (lfu_minutes() - (ent->access >> 8)) & (k_access_mask >> 8);
+  return elapsed < counter ? counter - elapsed : 0;
+}
+
+static std::minstd_rand &evict_rng()
+{
+  static thread_local std::minstd_rand rng(std::random_device{}());
+  return rng;
+}
+
+static void entry_touch(Entry *ent)
+{
+  if (g_evict_policy != EVICT_LFU)
+  {
+    ent->access = lru_clock();
+    return;
+  }
+  // the counter grows logarithmically: the higher it is, the less likely
+  // an access increments it
+  uint32_t counter = lfu_counter(ent);
+  if (counter < 0xFF)
+  {
+    uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+    std::uniform_int_distribution<uint32_t> dist(0, base * k_lfu_log_factor);
+    counter += dist(evict_rng()) == 0;
+  }
+  ent->access = (lfu_minutes() << 8) | counter;
+}
+
+// only the form the value formats back to, so GET returns the same bytes
+static bool str2int_exact(std::string_view s, int64_t &out)
+{
+  if (s.empty() || s.size() >= k_int_str_size)
+  {
+    return false;
+  }
+  size_t digits = s[0] == '-' ? 1 : 0;
+  if (s.size() > digits + 1 && s[digits] == '0')
+  {
+    return false; // leading zero
+  }
+  if (s == "-0")
+  {
+    return false;
+  }
+  std::from_chars_result rv = std::from_chars(s.data(), s.data() + s.size(), out);
+  return rv.ec == std::errc() && rv.ptr == s.data() + s.size();
+}
+
+Entry *entry_new(std::string_view key, uint64_t hcode, std::uint32_t type,
+                 std::string_view val)
+{
+  int64_t ival = 0;
+  bool small = val.size() <= k_inline_val_max && !str2int_exact(val, ival);
+  size_t vcap = type == T_STR && small ? val.size() : 0;
+  void *mem = malloc(sizeof(Entry) + key.size() + vcap);
+  if (!mem)
+  {
+    die("out of memory");
+  }
+  Entry *ent = new (mem) Entry();
+  ent->node.hcode = hcode;
+  ent->klen = (std::uint32_t)key.size();
+  ent->vcap = (std::uint32_t)vcap;
+  ent->type = type;
+  memcpy((char *)(ent + 1), key.data(), key.size());
+  ent->access = g_evict_policy == EVICT_LFU ? (lfu_minutes() << 8) | k_lfu_init : lru_clock();
+  if (type == T_ZSET)
+  {
+    ent->zset = new ZSet();
+  }
+  else if (type == T_HASH)
+  {
+    ent->hash = new Hash();
+  }
+  else if (type == T_LIST)
+  {
+    ent->list = new Deque();
+  }
+  g_data.mem += entry_mem(ent);
+  if (type == T_STR)
+  {
+    entry_set_str(ent, val); // accounts for the value
+  }
+  return ent;
+}
+
+size_t entry_mem(Entry *ent)
+{
+  size_t mem = sizeof(Entry) + ent->klen + ent->vcap;
+  if (ent->type == T_STR && ent->enc == ENC_RAW && ent->heap)
+  {
+    mem += ent->vlen;
+  }
+  else if (ent->type == T_ZSET)
+  {
+    mem += zset_mem(ent->zset);
+  }
+  else if (ent->type == T_HASH)
+  {
+    mem += hash_mem(ent->hash);
+  }
+  else if (ent->type == T_LIST)
+  {
+    mem += deque_mem(ent->list);
+  }
+  return mem;
+}
+
+std::string_view entry_key(const Entry *ent)
+{
+  return std::string_view((const char *)(ent + 1), ent->klen);
+}
+
+std::string_view entry_str(const Entry *ent, char (&buf)[k_int_str_size])
+{
+  if (ent->enc == ENC_INT)
+  {
+    std::to_chars_result rv = std::to_chars(buf, buf + sizeof(buf), ent->ival);
+    return std::string_view(buf, (size_t)(rv.ptr - buf));
+  }
+  const char *data = ent->heap ? ent->heap : (const char *)(ent + 1) + ent->klen;
+  return std::string_view(data, ent->vlen);
+}
+
+void entry_set_str(Entry *ent, std::string_view val)
+{
+  int64_t ival = 0;
+  if (str2int_exact(val, ival))
+  {
+    return entry_set_int(ent, ival);
+  }
+
+  size_t before = entry_mem(ent);
+  char *heap = ent->enc == ENC_RAW ? ent->heap : NULL;
+  char *data = NULL;
+  if (val.size() <= ent->vcap)
+  {
+    free(heap);
+    heap = NULL;
+    data = (char *)(ent + 1) + ent->klen;
+  }
+  else
+  {
+    heap = (char *)realloc(heap, val.size());
+    if (!heap)
+    {
+      die("out of memory");
+    }
+    data = heap;
+  }
+  memcpy(data, val.data(), val.size());
+  ent->enc = ENC_RAW;
+  ent->heap = heap;
+  ent->vlen = (std::uint32_t)val.size();
+  g_data.mem += entry_mem(ent) - before;
+}
+
+void entry_set_int(Entry *ent, int64_t val)
+{
+  size_t before = entry_mem(ent);
+  if (ent->enc == ENC_RAW)
+  {
+    free(ent->heap);
+  }
+  ent->enc = ENC_INT;
+  ent->ival = val;
+  ent->vlen = 0;
+  g_data.mem += entry_mem(ent) - before;
+}
+
+static void entry_destroy(Entry *ent)
+{
+  // Clean up based on type
+  switch (ent->type)
+  {
+  case T_ZSET:
+    zset_dispose(ent->zset);
+    delete ent->zset;
+    break;
+  case T_HASH:
+    hash_dispose(ent->hash);
+    delete ent->hash;
+    break;
+  case T_LIST:
+    deque_dispose(ent->list);
+    delete ent->list;
+    break;
+  case T_STR:
+    if (ent->enc == ENC_RAW)
+    {
+      free(ent->heap);
+    }
+    break;
+  default:
+    break;
+  }
+  free(ent);
+}
+
+static void entry_del_async(void *arg)
+{
+  entry_destroy((Entry *)arg);
+}
+
+static ThreadPool *bg_pool()
+{
+  // started on first use, shared by all the shards
+  static ThreadPool *tp = []
+  {
+    ThreadPool *p = new ThreadPool();
+    thread_pool_init(p, 1);
+    return p;
+  }();
+  return tp;
+}
+
+// the entry must already be unlinked from the keyspace
+void entry_del(Entry *ent)
+{
+  entry_set_ttl(ent, -1);
+  g_data.mem -= entry_mem(ent);
+  bool too_big = false;
+  switch (ent->type)
+  {
+  case T_ZSET:
+    too_big = hm_size(&ent->zset->hmap) > k_large_container_size;
+    break;
+  case T_HASH:
+    too_big = ent->hash->count > k_large_container_size;
+    break;
+  case T_LIST:
+    too_big = ent->list->count > k_large_container_size;
+    break;
+  case T_STR:
+    too_big = ent->vlen > k_large_str_size;
+    break;
+  default:
+    break;
+  }
+
+  if (too_big)
+  {
+    // nothing else references it, so no locking is needed
+    thread_pool_queue(bg_pool(), &entry_del_async, ent);
+  }
+  else
+  {
+    entry_destroy(ent);
+  }
+}
+
+void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+{
+  std::vector<HeapItem> &heap = g_data.heap;
+  size_t pos = ent->heap_idx;
+  if (ttl_ms < 0 && pos != k_no_ttl)
+  {
+    // fill the hole with the last item
+    heap[pos] = heap.back();
+    heap.pop_back();
+    if (pos < heap.size())
+    {
+      heap_update(heap.data(), pos, heap.size());
+    }
+    ent->heap_idx = k_no_ttl;
+  }
+  else if (ttl_ms >= 0)
+  {
+    if (pos == k_no_ttl)
+    {
+      HeapItem item;
+      item.ref = &ent->heap_idx;
+      heap.push_back(item);
+      pos = heap.size() - 1;
+    }
+    heap[pos].val = now_ms() + (uint64_t)ttl_ms;
+    heap_update(heap.data(), pos, heap.size());
+  }
+}
+
+static bool entry_expired(const Entry *ent, uint64_t now)
+{
+  return ent->heap_idx != k_no_ttl && g_data.heap[ent->heap_idx].val <= now;
+}
+
+static bool node_same(HNode *node, HNode *key)
+{
+  return node == key;
+}
+
+// unlink an entry from the db and free it
+static void db_remove(Entry *ent)
+{
+  hm_pop(&g_data.db, &ent->node, &node_same);
+  entry_del(ent);
+}
+
+// look up a key; one that has expired is removed here and not found
+static Entry *db_lookup(LookupKey *key)
+{
+  HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+  Entry *ent = node ? container_of(node, Entry, node) : nullptr;
+  if (ent && entry_expired(ent, now_ms()))
+  {
+    db_remove(ent);
+    return nullptr;
+  }
+  if (ent)
+  {
+    entry_touch(ent);
+  }
+  return ent;
+}
+
+size_t db_used_memory()
+{
+  HMapStats stats;
+  hm_stats(&g_data.db, &stats);
+  return g_data.mem + stats.bytes + g_data.heap.capacity() * sizeof(HeapItem);
+}
+
+void db_publish_stats()
+{
+  HMapStats db;
+  hm_stats(&g_data.db, &db);
+  g_db_stats.keys.set(db.size);
+  g_db_stats.buckets.set(db.buckets);
+  g_db_stats.rehash_buckets.set(db.rehash_buckets);
+  g_db_stats.rehash_pos.set(db.rehash_pos);
+  g_db_stats.expires.set(g_data.heap.size());
+  g_db_stats.used_memory.set(db_used_memory());
+  g_db_stats.evicted.set(g_data.evicted);
+}
+
+// keys sampled per eviction, and the candidates kept between evictions
+const size_t k_evict_samples = 5;
+const size_t k_evict_pool_size = 16;
+
+static uint64_t evict_score(const Entry *ent)
+{
+  if (g_evict_policy == EVICT_LFU)
+  {
+    return 0xFF - lfu_counter(ent);
+  }
+  return (lru_clock() - ent->access) & k_access_mask; // idle seconds
+}
+
+// sample a few keys and keep the ones better to evict than the pool has
+static void evict_pool_populate()
+{
+  std::vector<EvictCand> &pool = g_data.evict_pool;
+  HNode *nodes[k_evict_samples];
+  size_t n = hm_sample(&g_data.db, evict_rng()(), nodes, k_evict_samples);
+  for (size_t i = 0; i < n; ++i)
+  {
+    Entry *ent = container_of(nodes[i], Entry, node);
+    uint64_t score = evict_score(ent);
+    if (pool.size() == k_evict_pool_size && score <= pool[0].score)
+    {
+      continue;
+    }
+    auto it = std::upper_bound(pool.begin(), pool.end(), score,
+                               [](uint64_t v, const EvictCand &c)
+                               { return v < c.score; });
+    EvictCand cand;
+    cand.score = score;
+    cand.key = entry_key(ent);
+    pool.insert(it, std::move(cand));
+    if (pool.size() > k_evict_pool_size)
+    {
+      pool.erase(pool.begin());
+    }
+  }
+}
+
+// evict the best candidate still in the db
+static bool evict_one()
+{
+  std::vector<EvictCand> &pool = g_data.evict_pool;
+  evict_pool_populate();
+  while (!pool.empty())
+  {
+    LookupKey key;
+    lookup_key_init(&key, pool.back().key);
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    pool.pop_back(); // key views the string until here
+    if (node)
+    {
+      db_remove(container_of(node, Entry, node));
+      g_data.evicted++;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool db_evict()
+{
+  if (g_maxmemory == 0)
+  {
+    return true;
+  }
+  size_t limit = g_maxmemory / shard_key_owners();
+  while (db_used_memory() > limit)
+  {
+    if (g_evict_policy == EVICT_NONE || !evict_one())
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// expired keys removed between two clock reads
+const size_t k_expire_step = 32;
+
+bool db_expire(uint64_t budget_usec)
+{
+  std::vector<HeapItem> &heap = g_data.heap;
+  uint64_t start = get_monotonic_usec();
+  uint64_t now = start / 1000;
+  while (!heap.empty() && heap[0].val <= now)
+  {
+    for (size_t i = 0; i < k_expire_step && !heap.empty() && heap[0].val <= now; ++i)
+    {
+      db_remove(container_of(heap[0].ref, Entry, heap_idx));
+    }
+    if (get_monotonic_usec() - start >= budget_usec)
+    {
+      return !heap.empty() && heap[0].val <= now;
+    }
+  }
+  return false;
+}
+
+int db_next_timer_ms()
+{
+  std::vector<HeapItem> &heap = g_data.heap;
+  if (heap.empty())
+  {
+    return -1;
+  }
+  uint64_t now = now_ms();
+  if (heap[0].val <= now)
+  {
+    return 0;
+  }
+  return (int)std::min<uint64_t>(heap[0].val - now, INT32_MAX);
+}
+
+void do_get(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  if (cmd.size() != 2)
+  {
+    out_err(out, ERR_ARG, "GET requires 1 argument");
+    return;
+  }
+
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_nil(out);
+  }
+
+  if (ent->type != T_STR)
+  {
+    return out_err(out, ERR_TYPE, "expect string type");
+  }
+  char buf[k_int_str_size];
+  return out_str(out, entry_str(ent, buf));
+}
+
+void do_set(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  if (cmd.size() != 3)
+  {
+    out_err(out, ERR_ARG, "SET requires 2 arguments");
+    return;
+  }
+
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+
+  Entry *ent = db_lookup(&key);
+  if (ent)
+  {
+    if (ent->type != T_STR)
+    {
+      return out_err(out, ERR_TYPE, "expect string type");
+    }
+    entry_set_str(ent, cmd[2]);
+    entry_set_ttl(ent, -1);
+  }
+  else
+  {
+    ent = entry_new(cmd[1], key.node.hcode, T_STR, cmd[2]);
+    hm_insert(&g_data.db, &ent->node);
+  }
+  return out_nil(out);
+}
+
+// keys handled per prefetch round, small enough for their lines to stay in L1
+const size_t k_prefetch_batch = 16;
+
+// hash the keys cmd[first], cmd[first + step], ... up front
+static void lookup_keys_init(std::vector<LookupKey> &keys,
+                             std::vector<std::string_view> &cmd, size_t first, size_t step)
+{
+  keys.resize((cmd.size() - first + step - 1) / step);
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    lookup_key_init(&keys[i], cmd[first + i * step]);
+  }
+}
+
+// start loading the slots and then the chains of keys[from, from + batch)
+static void prefetch_keys(std::vector<LookupKey> &keys, size_t from)
+{
+  size_t to = std::min(keys.size(), from + k_prefetch_batch);
+  for (size_t i = from; i < to; ++i)
+  {
+    hm_prefetch_slot(&g_data.db, keys[i].node.hcode);
+  }
+  for (size_t i = from; i < to; ++i)
+  {
+    hm_prefetch_chain(&g_data.db, keys[i].node.hcode);
+  }
+}
+
+// DEL key [key ...]
+void do_del(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  if (cmd.size() < 2)
+  {
+    out_err(out, ERR_ARG, "DEL requires at least 1 argument");
+    return;
+  }
+
+  std::vector<LookupKey> keys;
+  lookup_keys_init(keys, cmd, 1, 1);
+  int64_t deleted = 0;
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    if (i % k_prefetch_batch == 0)
+    {
+      prefetch_keys(keys, i);
+    }
+    if (Entry *ent = db_lookup(&keys[i]))
+    {
+      db_remove(ent);
+      deleted++;
+    }
+  }
+  return out_int(out, deleted);
+}
+
+// MGET key [key ...]; keys that are missing or not strings are nil
+void do_mget(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  if (cmd.size() < 2)
+  {
+    out_err(out, ERR_ARG, "MGET requires at least 1 argument");
+    return;
+  }
+
+  std::vector<LookupKey> keys;
+  lookup_keys_init(keys, cmd, 1, 1);
+  out_arr(out, (std::uint32_t)keys.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    if (i % k_prefetch_batch == 0)
+    {
+      prefetch_keys(keys, i);
+    }
+    Entry *ent = db_lookup(&keys[i]);
+    if (ent && ent->type == T_STR)
+    {
+      char buf[k_int_str_size];
+      out_str(out, entry_str(ent, buf));
+    }
+    else
+    {
+      out_nil(out);
+    }
+  }
+}
+
+// MSET key value [key value ...]; existing keys of any type are replaced
+void do_mset(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  if (cmd.size() < 3 || cmd.size() % 2 != 1)
+  {
+    out_err(out, ERR_ARG, "MSET requires key value pairs");
+    return;
+  }
+
+  std::vector<LookupKey> keys;
+  lookup_keys_init(keys, cmd, 1, 2);
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    if (i % k_prefetch_batch == 0)
+    {
+      prefetch_keys(keys, i);
+    }
+    std::string_view val = cmd[2 + i * 2];
+    // looked up one at a time, a key may repeat within the request
+    Entry *ent = db_lookup(&keys[i]);
+    if (ent && ent->type != T_STR)
+    {
+      db_remove(ent);
+      ent = nullptr;
+    }
+    if (ent)
+    {
+      entry_set_str(ent, val);
+      entry_set_ttl(ent, -1);
+      continue;
+    }
+    ent = entry_new(keys[i].key, keys[i].node.hcode, T_STR, val);
+    hm_insert(&g_data.db, &ent->node);
+  }
+  return out_nil(out);
+}
+
+// INCR key, DECR key, INCRBY key n
+void do_incr(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  int64_t by = cmd_is(cmd[0], "decr") ? -1 : 1;
+  if (cmd.size() == 3 && !str2int_exact(cmd[2], by))
+  {
+    return out_err(out, ERR_ARG, "expect integer increment");
+  }
+
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    ent = entry_new(cmd[1], key.node.hcode, T_STR);
+    entry_set_int(ent, by);
+    hm_insert(&g_data.db, &ent->node);
+    return out_int(out, by);
+  }
+
+  if (ent->type != T_STR)
+  {
+    return out_err(out, ERR_TYPE, "expect string type");
+  }
+  if (ent->enc != ENC_INT)
+  {
+    return out_err(out, ERR_TYPE, "value is not an integer");
+  }
+  int64_t val = ent->ival;
+  if ((by > 0 && val > INT64_MAX - by) || (by < 0 && val < INT64_MIN - by))
+  {
+    return out_err(out, ERR_ARG, "increment would overflow");
+  }
+  ent->ival = val + by;
+  return out_int(out, ent->ival);
+}
+
+static bool str2ldbl(std::string_view s, long double &out)
+{
+  std::string tmp(s);
+  char *endp = nullptr;
+  out = strtold(tmp.c_str(), &endp);
+  return !tmp.empty() && endp == tmp.c_str() + tmp.size() && isfinite(out);
 }
 
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg)
+// INCRBYFLOAT key n; the result is stored as a string, or as an integer
+// if it formats as one
+void do_incrbyfloat(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  if (tab->size == 0)
+  long double by = 0;
+  if (!str2ldbl(cmd[2], by))
   {
-    return;
+    return out_err(out, ERR_ARG, "expect floating-point increment");
   }
-  for (size_t i = 0; i < tab->mask + 1; ++i)
+
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  long double val = 0;
+  if (ent && ent->type != T_STR)
+  {
+    return out_err(out, ERR_TYPE, "expect string type");
+  }
+  if (ent && ent->enc == ENC_INT)
   {
-    HNode *node = tab->tab[i];
-    while (node)
+    val = (long double)ent->ival;
+  }
+  else if (ent)
+  {
+    char buf[k_int_str_size];
+    if (!str2ldbl(entry_str(ent, buf), val))
     {
-      f(node, arg);
-      node = node->next;
+      return out_err(out, ERR_TYPE, "value is not a number");
     }
   }
+
+  val += by;
+  if (!isfinite(val))
+  {
+    return out_err(out, ERR_ARG, "increment would produce NaN or infinity");
+  }
+  // 17 digits so the value survives the round trip through the string
+  char str[64];
+  int len = snprintf(str, sizeof(str), "%.17Lg", val);
+  if (ent)
+  {
+    entry_set_str(ent, std::string_view(str, (size_t)len));
+  }
+  else
+  {
+    ent = entry_new(cmd[1], key.node.hcode, T_STR, std::string_view(str, (size_t)len));
+    hm_insert(&g_data.db, &ent->node);
+  }
+  return out_dbl(out, (double)val);
 }
 
-static void cb_scan(HNode *node, void *arg)
+// EXPIRE key seconds, PEXPIRE key ms; 1 if the key exists, 0 if not.
+// A TTL of 0 or less deletes the key.
+void do_expire(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  std::string &out = *(std::string *)arg;
-  out_str(out, container_of(node, Entry, node)->key);
+  int64_t ttl = 0;
+  if (!str2int(cmd[2], ttl))
+  {
+    return out_err(out, ERR_ARG, "expect integer TTL");
+  }
+  if (cmd_is(cmd[0], "expire"))
+  {
+    if (ttl > INT64_MAX / 1000 || ttl < INT64_MIN / 1000)
+    {
+      return out_err(out, ERR_ARG, "TTL out of range");
+    }
+    ttl *= 1000;
+  }
+
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_int(out, 0);
+  }
+  if (ttl <= 0)
+  {
+    db_remove(ent);
+  }
+  else
+  {
+    entry_set_ttl(ent, ttl);
+  }
+  return out_int(out, 1);
 }
 
-void do_get(std::vector<std::string> &cmd, std::string &out)
+// TTL key in seconds, PTTL key in ms; -2 if the key is missing, -1 if it
+// does not expire
+void do_ttl(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  if (cmd.size() != 2)
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
   {
-    out_err(out, ERR_ARG, "GET requires 1 argument");
-    return;
+    return out_int(out, -2);
   }
+  if (ent->heap_idx == k_no_ttl)
+  {
+    return out_int(out, -1);
+  }
+  uint64_t at = g_data.heap[ent->heap_idx].val;
+  uint64_t now = now_ms();
+  int64_t ms = at > now ? (int64_t)(at - now) : 0;
+  return out_int(out, cmd_is(cmd[0], "ttl") ? (ms + 500) / 1000 : ms);
+}
 
-  Entry key;
-  key.key = cmd[1];
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+struct KeysCtx
+{
+  Buffer *out = NULL;
+  size_t start = 0;
+  uint64_t now = 0;
+  std::uint32_t n = 0;
+};
 
-  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (!node)
+static void cb_keys(HNode *node, void *arg)
+{
+  KeysCtx *ctx = (KeysCtx *)arg;
+  Entry *ent = container_of(node, Entry, node);
+  if (!entry_expired(ent, ctx->now) && !out_too_big(*ctx->out, ctx->start))
   {
-    return out_nil(out);
+    out_str(*ctx->out, entry_key(ent));
+    ctx->n++;
   }
+}
 
-  Entry *ent = container_of(node, Entry, node);
-  if (ent->type != T_STR)
+void do_keys(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  (void)cmd;
+  // expired keys not removed yet are skipped, so count as they go out
+  KeysCtx ctx;
+  ctx.out = &out;
+  ctx.start = out.size;
+  ctx.now = now_ms();
+  size_t arr = begin_arr(out);
+  hm_foreach(&g_data.db, &cb_keys, &ctx);
+  end_arr(out, arr, ctx.n);
+}
+
+// glob-style match: * ? [abc] [^a-z] and \ to escape
+static bool glob_match(std::string_view pat, std::string_view str)
+{
+  size_t p = 0, s = 0;
+  // where to resume after a mismatch: the last * and the text it covers
+  size_t star = std::string_view::npos, star_s = 0;
+  while (s < str.size())
   {
-    return out_err(out, ERR_TYPE, "expect string type");
+    if (p < pat.size() && pat[p] == '*')
+    {
+      star = p++;
+      star_s = s;
+      continue;
+    }
+    bool ok = false;
+    size_t next = p + 1;
+    if (p < pat.size() && pat[p] == '?')
+    {
+      ok = true;
+    }
+    else if (p < pat.size() && pat[p] == '[')
+    {
+      size_t i = p + 1;
+      bool negate = i < pat.size() && pat[i] == '^';
+      i += negate;
+      bool hit = false;
+      for (bool first = true; i < pat.size() && (first || pat[i] != ']'); first = false)
+      {
+        if (pat[i] == '\\' && i + 1 < pat.size())
+        {
+          i++;
+        }
+        if (i + 2 < pat.size() && pat[i + 1] == '-' && pat[i + 2] != ']')
+        {
+          char lo = std::min(pat[i], pat[i + 2]), hi = std::max(pat[i], pat[i + 2]);
+          hit = hit || (str[s] >= lo && str[s] <= hi);
+          i += 3;
+        }
+        else
+        {
+          hit = hit || str[s] == pat[i];
+          i++;
+        }
+      }
+      ok = hit != negate;
+      next = i < pat.size() ? i + 1 : i; // past the ]
+    }
+    else if (p < pat.size())
+    {
+      if (pat[p] == '\\' && p + 1 < pat.size())
+      {
+        next = ++p + 1;
+      }
+      ok = pat[p] == str[s];
+    }
+
+    if (ok)
+    {
+      p = next;
+      s++;
+    }
+    else if (star != std::string_view::npos)
+    {
+      // let the last * swallow one more character
+      p = star + 1;
+      s = ++star_s;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  while (p < pat.size() && pat[p] == '*')
+  {
+    p++;
   }
-  return out_str(out, ent->val);
+  return p == pat.size();
 }
 
-void do_set(std::vector<std::string> &cmd, std::string &out)
+struct ScanCtx
 {
-  if (cmd.size() != 3)
+  std::string_view pattern;
+  uint64_t now = 0;
+  std::vector<Entry *> found;
+};
+
+static void cb_scan_match(HNode *node, void *arg)
+{
+  ScanCtx *ctx = (ScanCtx *)arg;
+  Entry *ent = container_of(node, Entry, node);
+  if (entry_expired(ent, ctx->now))
   {
-    out_err(out, ERR_ARG, "SET requires 2 arguments");
     return;
   }
+  if (ctx->pattern.empty() || glob_match(ctx->pattern, entry_key(ent)))
+  {
+    ctx->found.push_back(ent);
+  }
+}
 
-  Entry key;
-  key.key = cmd[1];
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+const int64_t k_scan_default_count = 10;
+const int64_t k_scan_max_count = 1000;
 
-  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (node)
+// parses "cursor [MATCH pattern] [COUNT n]", false after replying an error
+static bool scan_args(std::vector<std::string_view> &cmd, ScanCtx &ctx,
+                      int64_t &cursor, int64_t &count, Buffer &out, const char *usage)
+{
+  if (!str2int(cmd[1], cursor) || cursor < 0)
   {
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR)
+    out_err(out, ERR_ARG, "expect a cursor");
+    return false;
+  }
+  ctx.now = now_ms();
+  count = k_scan_default_count;
+  for (size_t i = 2; i < cmd.size(); i += 2)
+  {
+    if (i + 1 == cmd.size())
     {
-      return out_err(out, ERR_TYPE, "expect string type");
+      out_err(out, ERR_ARG, usage);
+      return false;
+    }
+    if (cmd_is(cmd[i], "match"))
+    {
+      ctx.pattern = cmd[i + 1];
+    }
+    else if (cmd_is(cmd[i], "count") && str2int(cmd[i + 1], count) && count > 0)
+    {
+      count = std::min(count, k_scan_max_count);
+    }
+    else
+    {
+      out_err(out, ERR_ARG, usage);
+      return false;
     }
-    ent->val = cmd[2];
   }
-  else
+  return true;
+}
+
+// collects about count keys into ctx.found and returns the next cursor.
+// With sharding the cursor also says which shard is being scanned.
+static uint64_t scan_run(ScanCtx &ctx, int64_t cursor, int64_t count)
+{
+  uint64_t nshards = shard_key_owners();
+  uint64_t shard = (uint64_t)cursor % nshards;
+  size_t pos = (size_t)((uint64_t)cursor / nshards);
+  // bounded work: stop after count buckets visited without enough matches
+  for (int64_t steps = 0; steps < count * 10; ++steps)
   {
-    Entry *ent = new Entry();
-    ent->key = cmd[1];
-    ent->node.hcode = key.node.hcode;
-    ent->val = cmd[2];
-    ent->type = T_STR;
-    hm_insert(&g_data.db, &ent->node);
+    pos = hm_scan(&g_data.db, pos, &cb_scan_match, &ctx);
+    if (pos == 0 || (int64_t)ctx.found.size() >= count)
+    {
+      break;
+    }
   }
-  return out_nil(out);
+
+  if (pos != 0)
+  {
+    return (uint64_t)pos * nshards + shard;
+  }
+  if (shard + 1 < nshards)
+  {
+    return shard + 1; // on to the next shard
+  }
+  return 0;
 }
 
-void do_del(std::vector<std::string> &cmd, std::string &out)
+// SCAN cursor [MATCH pattern] [COUNT n]
+// replies [next cursor, [keys...]]; the scan is complete when the cursor is 0.
+void do_scan(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  if (cmd.size() != 2)
+  ScanCtx ctx;
+  int64_t cursor = 0, count = 0;
+  if (!scan_args(cmd, ctx, cursor, count, out, "expect SCAN cursor [MATCH pattern] [COUNT n]"))
   {
-    out_err(out, ERR_ARG, "DEL requires 1 argument");
     return;
   }
+  uint64_t next = scan_run(ctx, cursor, count);
+  out_arr(out, 2);
+  out_int(out, (int64_t)next);
+  out_arr(out, (std::uint32_t)ctx.found.size());
+  for (Entry *ent : ctx.found)
+  {
+    out_str(out, entry_key(ent));
+  }
+}
 
-  Entry key;
-  key.key = cmd[1];
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static const char *entry_type_name(const Entry *ent)
+{
+  switch (ent->type)
+  {
+  case T_STR:
+    return "string";
+  case T_ZSET:
+    return "zset";
+  case T_HASH:
+    return "hash";
+  case T_LIST:
+    return "list";
+  default:
+    return "none";
+  }
+}
 
-  HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
-  if (node)
+// bytes of a string, members of a collection
+static size_t entry_len(Entry *ent)
+{
+  switch (ent->type)
   {
-    Entry *ent = container_of(node, Entry, node);
-    // Clean up based on type
-    switch (ent->type)
-    {
-    case T_ZSET:
-      zset_dispose(ent->zset);
-      delete ent->zset;
-      break;
-    case T_STR:
-      // No additional cleanup needed
-      break;
-    default:
-      break;
-    }
-    delete ent;
+  case T_STR:
+  {
+    char buf[k_int_str_size];
+    return entry_str(ent, buf).size();
+  }
+  case T_ZSET:
+    return hm_size(&ent->zset->hmap);
+  case T_HASH:
+    return ent->hash->count;
+  case T_LIST:
+    return ent->list->count;
+  default:
+    return 0;
   }
-  return out_int(out, node ? 1 : 0);
 }
 
-void do_keys(std::vector<std::string> &cmd, std::string &out)
+// MEMORY USAGE key
+// the bytes of the entry and its value: for a zset the tree and hash nodes,
+// the member names and the member index, as counted against maxmemory
+void do_memory(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  (void)cmd;
-  out_arr(out, (std::uint32_t)hm_size(&g_data.db));
-  h_scan(&g_data.db.ht1, &cb_scan, &out);
-  h_scan(&g_data.db.ht2, &cb_scan, &out);
+  if (!cmd_is(cmd[1], "usage"))
+  {
+    return out_err(out, ERR_ARG, "expect MEMORY USAGE key");
+  }
+  LookupKey key;
+  lookup_key_init(&key, cmd[2]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_nil(out);
+  }
+  out_int(out, (int64_t)entry_mem(ent));
+}
+
+// BIGKEYS cursor [MATCH pattern] [COUNT n]
+// a SCAN that replies [next cursor, [key, type, bytes, length, ...]], so a
+// client can rank the whole keyspace a few keys per call (client --bigkeys)
+void do_bigkeys(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  ScanCtx ctx;
+  int64_t cursor = 0, count = 0;
+  if (!scan_args(cmd, ctx, cursor, count, out, "expect BIGKEYS cursor [MATCH pattern] [COUNT n]"))
+  {
+    return;
+  }
+  uint64_t next = scan_run(ctx, cursor, count);
+  out_arr(out, 2);
+  out_int(out, (int64_t)next);
+  out_arr(out, (std::uint32_t)ctx.found.size() * 4);
+  for (Entry *ent : ctx.found)
+  {
+    out_str(out, entry_key(ent));
+    out_str(out, entry_type_name(ent));
+    out_int(out, (int64_t)entry_mem(ent));
+    out_int(out, (int64_t)entry_len(ent));
+  }
 }
 
-void do_zadd(std::vector<std::string> &cmd, std::string &out)
+void do_zadd(std::vector<std::string_view> &cmd, Buffer &out)
 {
   if (cmd.size() != 4)
   {
@@ -159,37 +1182,28 @@ void do_zadd(std::vector<std::string> &cmd, std::string &out)
     return out_err(out, ERR_ARG, "expect floating-point number for score");
   }
 
-  Entry key;
-  key.key = cmd[1];
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-  HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  Entry *ent = nullptr;
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
 
-  if (!hnode)
+  Entry *ent = db_lookup(&key);
+  if (!ent)
   {
-    ent = new Entry();
-    ent->key = cmd[1];
-    ent->node.hcode = key.node.hcode;
-    ent->type = T_ZSET;
-    ent->zset = new ZSet();
+    ent = entry_new(cmd[1], key.node.hcode, T_ZSET);
     hm_insert(&g_data.db, &ent->node);
   }
-  else
+  else if (ent->type != T_ZSET)
   {
-    ent = container_of(hnode, Entry, node);
-    if (ent->type != T_ZSET)
-    {
-      return out_err(out, ERR_TYPE, "expect zset");
-    }
+    return out_err(out, ERR_TYPE, "expect zset");
   }
 
-  const std::string &name = cmd[3];
+  std::string_view name = cmd[3];
+  size_t before = entry_mem(ent);
   bool added = zset_add(ent->zset, name, score);
+  g_data.mem += entry_mem(ent) - before;
   return out_int(out, (int64_t)added);
 }
 
-void do_zrem(std::vector<std::string> &cmd, std::string &out)
+void do_zrem(std::vector<std::string_view> &cmd, Buffer &out)
 {
   if (cmd.size() != 3)
   {
@@ -203,16 +1217,18 @@ void do_zrem(std::vector<std::string> &cmd, std::string &out)
     return;
   }
 
-  const std::string &name = cmd[2];
+  std::string_view name = cmd[2];
+  size_t before = entry_mem(ent);
   ZNode *znode = zset_pop(ent->zset, name);
   if (znode)
   {
     znode_del(znode);
   }
+  g_data.mem += entry_mem(ent) - before;
   return out_int(out, znode ? 1 : 0);
 }
 
-void do_zscore(std::vector<std::string> &cmd, std::string &out)
+void do_zscore(std::vector<std::string_view> &cmd, Buffer &out)
 {
   if (cmd.size() != 3)
   {
@@ -226,12 +1242,12 @@ void do_zscore(std::vector<std::string> &cmd, std::string &out)
     return;
   }
 
-  const std::string &name = cmd[2];
+  std::string_view name = cmd[2];
   ZNode *znode = zset_lookup(ent->zset, name);
   return znode ? out_dbl(out, znode->score) : out_nil(out);
 }
 
-void do_zquery(std::vector<std::string> &cmd, std::string &out)
+void do_zquery(std::vector<std::string_view> &cmd, Buffer &out)
 {
   if (cmd.size() != 6)
   {
@@ -244,7 +1260,7 @@ void do_zquery(std::vector<std::string> &cmd, std::string &out)
   {
     return out_err(out, ERR_ARG, "expect floating-point number for score");
   }
-  const std::string &name = cmd[3];
+  std::string_view name = cmd[3];
   int64_t offset = 0;
   int64_t limit = 0;
   if (!str2int(cmd[4], offset))
@@ -257,11 +1273,13 @@ void do_zquery(std::vector<std::string> &cmd, std::string &out)
   }
 
   Entry *ent = nullptr;
+  size_t start = out.size;
   if (!expect_zset(out, cmd[1], &ent))
   {
-    if (out[0] == SER_NIL)
+    if (out.data[start] == SER_NIL)
     {
-      out.clear();
+      // a missing key is an empty result
+      out.size = start;
       out_arr(out, 0);
     }
     return;
@@ -283,7 +1301,7 @@ void do_zquery(std::vector<std::string> &cmd, std::string &out)
 
   size_t arr_pos = begin_arr(out);
   uint32_t n = 0;
-  while (znode && static_cast<int64_t>(n) < limit)
+  while (znode && static_cast<int64_t>(n) < limit && !out_too_big(out, start))
   {
     out_str(out, znode->name);
     out_dbl(out, znode->score);
@@ -293,93 +1311,314 @@ void do_zquery(std::vector<std::string> &cmd, std::string &out)
   end_arr(out, arr_pos, n);
 }
 
-// Utility Functions Implementation
+// the hash at the key, created if missing when create is set; false after
+// replying nil or a type error
+static bool expect_hash(Buffer &out, std::string_view s, Entry **ent, bool create)
+{
+  LookupKey key;
+  lookup_key_init(&key, s);
+  *ent = db_lookup(&key);
+  if (!*ent && create)
+  {
+    *ent = entry_new(s, key.node.hcode, T_HASH);
+    hm_insert(&g_data.db, &(*ent)->node);
+    return true;
+  }
+  if (!*ent)
+  {
+    out_nil(out);
+    return false;
+  }
+  if ((*ent)->type != T_HASH)
+  {
+    out_err(out, ERR_TYPE, "expect hash");
+    return false;
+  }
+  return true;
+}
 
-bool str2dbl(const std::string &s, double &out)
+// HSET key field value [field value ...], replies the number of new fields
+void do_hset(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  char *endp = nullptr;
-  out = strtod(s.c_str(), &endp);
-  return endp == s.c_str() + s.size() && !isnan(out);
+  if (cmd.size() % 2 != 0)
+  {
+    return out_err(out, ERR_ARG, "expect HSET key field value [field value ...]");
+  }
+  Entry *ent = nullptr;
+  if (!expect_hash(out, cmd[1], &ent, true))
+  {
+    return;
+  }
+  size_t before = entry_mem(ent);
+  int64_t added = 0;
+  for (size_t i = 2; i < cmd.size(); i += 2)
+  {
+    added += hash_set(ent->hash, cmd[i], cmd[i + 1]);
+  }
+  g_data.mem += entry_mem(ent) - before;
+  out_int(out, added);
 }
 
-bool str2int(const std::string &s, int64_t &out)
+void do_hget(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  char *endp = nullptr;
-  out = strtoll(s.c_str(), &endp, 10);
-  return endp == s.c_str() + s.size();
+  Entry *ent = nullptr;
+  if (!expect_hash(out, cmd[1], &ent, false))
+  {
+    return;
+  }
+  std::string_view val;
+  if (!hash_get(ent->hash, cmd[2], &val))
+  {
+    return out_nil(out);
+  }
+  out_str(out, val);
 }
 
-bool expect_zset(std::string &out, std::string &s, Entry **ent)
+// HDEL key field [field ...]; the key goes with its last field
+void do_hdel(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  Entry key;
-  key.key = s;
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (!hnode)
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
   {
-    out_nil(out);
-    return false;
+    return out_int(out, 0);
   }
+  if (ent->type != T_HASH)
+  {
+    return out_err(out, ERR_TYPE, "expect hash");
+  }
+  size_t before = entry_mem(ent);
+  int64_t removed = 0;
+  for (size_t i = 2; i < cmd.size(); ++i)
+  {
+    removed += hash_del(ent->hash, cmd[i]);
+  }
+  g_data.mem += entry_mem(ent) - before;
+  if (ent->hash->count == 0)
+  {
+    db_remove(ent);
+  }
+  out_int(out, removed);
+}
 
-  *ent = container_of(hnode, Entry, node);
-  if ((*ent)->type != T_ZSET)
+// the reply being built and where it began, for the callbacks
+struct ReplyCtx
+{
+  Buffer *out = NULL;
+  size_t start = 0;
+};
+
+static void cb_hgetall(std::string_view field, std::string_view val, void *arg)
+{
+  ReplyCtx *ctx = (ReplyCtx *)arg;
+  if (!out_too_big(*ctx->out, ctx->start))
   {
-    out_err(out, ERR_TYPE, "expect zset");
-    return false;
+    out_str(*ctx->out, field);
+    out_str(*ctx->out, val);
   }
-  return true;
 }
 
-void out_nil(std::string &out)
+// HGETALL key: [field, value, ...], empty for a missing key
+void do_hgetall(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_arr(out, 0);
+  }
+  if (ent->type != T_HASH)
+  {
+    return out_err(out, ERR_TYPE, "expect hash");
+  }
+  ReplyCtx ctx;
+  ctx.out = &out;
+  ctx.start = out.size;
+  out_arr(out, ent->hash->count * 2);
+  hash_foreach(ent->hash, &cb_hgetall, &ctx);
+}
+
+// HINCRBY key field n; a missing field counts as 0
+void do_hincrby(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  int64_t by = 0;
+  if (!str2int_exact(cmd[3], by))
+  {
+    return out_err(out, ERR_ARG, "expect integer increment");
+  }
+  Entry *ent = nullptr;
+  if (!expect_hash(out, cmd[1], &ent, true))
+  {
+    return;
+  }
+  int64_t val = 0;
+  std::string_view old;
+  if (hash_get(ent->hash, cmd[2], &old) && !str2int_exact(old, val))
+  {
+    return out_err(out, ERR_TYPE, "hash value is not an integer");
+  }
+  if ((by > 0 && val > INT64_MAX - by) || (by < 0 && val < INT64_MIN - by))
+  {
+    return out_err(out, ERR_ARG, "increment would overflow");
+  }
+  val += by;
+  char buf[k_int_str_size];
+  std::to_chars_result rv = std::to_chars(buf, buf + sizeof(buf), val);
+  size_t before = entry_mem(ent);
+  hash_set(ent->hash, cmd[2], std::string_view(buf, rv.ptr - buf));
+  g_data.mem += entry_mem(ent) - before;
+  out_int(out, val);
+}
+
+// LPUSH/RPUSH key value [value ...], replies the new length
+void do_push(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  out.push_back(SER_NIL);
+  bool front = cmd_is(cmd[0], "lpush");
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    ent = entry_new(cmd[1], key.node.hcode, T_LIST);
+    hm_insert(&g_data.db, &ent->node);
+  }
+  else if (ent->type != T_LIST)
+  {
+    return out_err(out, ERR_TYPE, "expect list");
+  }
+  size_t before = entry_mem(ent);
+  for (size_t i = 2; i < cmd.size(); ++i)
+  {
+    deque_push(ent->list, cmd[i], front);
+  }
+  g_data.mem += entry_mem(ent) - before;
+  out_int(out, (int64_t)ent->list->count);
 }
 
-void out_str(std::string &out, const std::string &val)
+// LPOP/RPOP key; the key goes with its last element
+void do_pop(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  out.push_back(SER_STR);
-  std::uint32_t len = (std::uint32_t)val.size();
-  out.append((char *)&len, 4);
-  out.append(val);
+  bool front = cmd_is(cmd[0], "lpop");
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_nil(out);
+  }
+  if (ent->type != T_LIST)
+  {
+    return out_err(out, ERR_TYPE, "expect list");
+  }
+  std::string_view val;
+  deque_peek(ent->list, front, &val);
+  out_str(out, val);
+  size_t before = entry_mem(ent);
+  deque_pop(ent->list, front);
+  g_data.mem += entry_mem(ent) - before;
+  if (ent->list->count == 0)
+  {
+    db_remove(ent);
+  }
 }
 
-void out_int(std::string &out, int64_t val)
+static void cb_lrange(std::string_view val, void *arg)
 {
-  out.push_back(SER_INT);
-  out.append((char *)&val, 8);
+  ReplyCtx *ctx = (ReplyCtx *)arg;
+  if (!out_too_big(*ctx->out, ctx->start))
+  {
+    out_str(*ctx->out, val);
+  }
 }
 
-void out_dbl(std::string &out, double val)
+// LRANGE key start stop: the elements from start to stop inclusive,
+// negative indexes count from the end
+void do_lrange(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  out.push_back(SER_DBL);
-  out.append((char *)&val, 8);
+  int64_t start = 0, stop = 0;
+  if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+  {
+    return out_err(out, ERR_ARG, "expect integer for start and stop");
+  }
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_arr(out, 0);
+  }
+  if (ent->type != T_LIST)
+  {
+    return out_err(out, ERR_TYPE, "expect list");
+  }
+  int64_t len = (int64_t)ent->list->count;
+  start = start < 0 ? std::max(start + len, (int64_t)0) : start;
+  stop = stop < 0 ? stop + len : std::min(stop, len - 1);
+  if (start > stop)
+  {
+    return out_arr(out, 0);
+  }
+  size_t n = (size_t)(stop - start + 1);
+  ReplyCtx ctx;
+  ctx.out = &out;
+  ctx.start = out.size;
+  out_arr(out, (std::uint32_t)n);
+  deque_range(ent->list, (size_t)start, n, &cb_lrange, &ctx);
 }
 
-void out_err(std::string &out, int32_t code, const std::string &m)
+void do_llen(std::vector<std::string_view> &cmd, Buffer &out)
 {
-  out.push_back(SER_ERR);
-  out.append((char *)&code, 4);
-  std::uint32_t len = (std::uint32_t)m.size();
-  out.append((char *)&len, 4);
-  out.append(m);
+  LookupKey key;
+  lookup_key_init(&key, cmd[1]);
+  Entry *ent = db_lookup(&key);
+  if (!ent)
+  {
+    return out_int(out, 0);
+  }
+  if (ent->type != T_LIST)
+  {
+    return out_err(out, ERR_TYPE, "expect list");
+  }
+  out_int(out, (int64_t)ent->list->count);
 }
 
-void out_arr(std::string &out, std::uint32_t n)
+// Utility Functions Implementation
+
+// the views are not NUL-terminated; numbers are short enough for the SSO
+// buffer, so the copy does not allocate
+bool str2dbl(std::string_view s, double &out)
 {
-  out.push_back(SER_ARR);
-  out.append((char *)&n, 4);
+  std::string tmp(s);
+  char *endp = nullptr;
+  out = strtod(tmp.c_str(), &endp);
+  return endp == tmp.c_str() + tmp.size() && !isnan(out);
 }
 
-size_t begin_arr(std::string &out)
+bool str2int(std::string_view s, int64_t &out)
 {
-  out.push_back(SER_ARR);
-  out.append("\0\0\0\0", 4); // Placeholder for array length
-  return out.size() - 4;     // Return position as size_t
+  std::string tmp(s);
+  char *endp = nullptr;
+  out = strtoll(tmp.c_str(), &endp, 10);
+  return endp == tmp.c_str() + tmp.size();
 }
 
-void end_arr(std::string &out, size_t ctx, std::uint32_t n)
+bool expect_zset(Buffer &out, std::string_view s, Entry **ent)
 {
-  size_t pos = ctx;
-  assert(out[pos - 1] == SER_ARR);
-  memcpy(&out[pos], &n, 4);
+  LookupKey key;
+  lookup_key_init(&key, s);
+  *ent = db_lookup(&key);
+  if (!*ent)
+  {
+    out_nil(out);
+    return false;
+  }
+
+  if ((*ent)->type != T_ZSET)
+  {
+    out_err(out, ERR_TYPE, "expect zset");
+    return false;
+  }
+  return true;
 }
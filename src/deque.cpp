@@ -0,0 +1,219 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <new>
+#include "deque.h"
+#include "common.h"
+
+const uint8_t k_long_len = 0xFF;
+
+static size_t len_size(size_t len)
+{
+  return len < k_long_len ? 1 : 5;
+}
+
+static size_t elem_size(size_t len)
+{
+  return len + 2 * len_size(len);
+}
+
+static char *chunk_data(DequeChunk *chunk)
+{
+  return (char *)(chunk + 1);
+}
+
+static DequeChunk *chunk_of(DList *link)
+{
+  return container_of(link, DequeChunk, link);
+}
+
+// write the element at p: the length, the bytes, the length mirrored
+static void elem_write(char *p, std::string_view val)
+{
+  uint32_t len = (uint32_t)val.size();
+  if (len < k_long_len)
+  {
+    p[0] = (char)len;
+    memcpy(p + 1, val.data(), len);
+    p[1 + len] = (char)len;
+    return;
+  }
+  p[0] = (char)k_long_len;
+  memcpy(p + 1, &len, 4);
+  memcpy(p + 5, val.data(), len);
+  memcpy(p + 5 + len, &len, 4);
+  p[9 + len] = (char)k_long_len;
+}
+
+// the element starting at p
+static std::string_view elem_read(const char *p)
+{
+  uint32_t len = (uint8_t)p[0];
+  if (len < k_long_len)
+  {
+    return std::string_view(p + 1, len);
+  }
+  memcpy(&len, p + 1, 4);
+  return std::string_view(p + 5, len);
+}
+
+// the element ending right before p
+static std::string_view elem_read_back(const char *p)
+{
+  uint32_t len = (uint8_t)p[-1];
+  if (len < k_long_len)
+  {
+    return std::string_view(p - 1 - len, len);
+  }
+  memcpy(&len, p - 5, 4);
+  return std::string_view(p - 5 - len, len);
+}
+
+// a new first or last chunk for an element of need bytes
+static DequeChunk *chunk_new(Deque *deque, size_t need, bool front, bool middle)
+{
+  size_t size = sizeof(DequeChunk) + need > k_deque_chunk_size
+                    ? sizeof(DequeChunk) + need
+                    : k_deque_chunk_size;
+  void *mem = malloc(size);
+  if (!mem)
+  {
+    die("Out of memory");
+  }
+  DequeChunk *chunk = new (mem) DequeChunk();
+  chunk->cap = (uint32_t)(size - sizeof(DequeChunk));
+  // the first chunk can grow both ways, later ones only away from the rest
+  uint32_t pos = front ? chunk->cap : 0;
+  if (middle)
+  {
+    pos = (chunk->cap - (uint32_t)need) / 2 + (front ? (uint32_t)need : 0);
+  }
+  chunk->begin = chunk->end = pos;
+  if (front)
+  {
+    dlist_insert_before(deque->chunks.next, &chunk->link);
+  }
+  else
+  {
+    dlist_insert_before(&deque->chunks, &chunk->link);
+  }
+  deque->mem += size;
+  return chunk;
+}
+
+void deque_push(Deque *deque, std::string_view val, bool front)
+{
+  size_t need = elem_size(val.size());
+  DequeChunk *chunk = NULL;
+  if (!dlist_empty(&deque->chunks))
+  {
+    chunk = chunk_of(front ? deque->chunks.next : deque->chunks.prev);
+    size_t room = front ? chunk->begin : chunk->cap - chunk->end;
+    if (room < need)
+    {
+      chunk = NULL;
+    }
+  }
+  if (!chunk)
+  {
+    chunk = chunk_new(deque, need, front, dlist_empty(&deque->chunks));
+  }
+
+  if (front)
+  {
+    chunk->begin -= (uint32_t)need;
+    elem_write(chunk_data(chunk) + chunk->begin, val);
+  }
+  else
+  {
+    elem_write(chunk_data(chunk) + chunk->end, val);
+    chunk->end += (uint32_t)need;
+  }
+  chunk->count++;
+  deque->count++;
+}
+
+bool deque_peek(Deque *deque, bool front, std::string_view *val)
+{
+  if (dlist_empty(&deque->chunks))
+  {
+    return false;
+  }
+  DequeChunk *chunk = chunk_of(front ? deque->chunks.next : deque->chunks.prev);
+  *val = front ? elem_read(chunk_data(chunk) + chunk->begin)
+               : elem_read_back(chunk_data(chunk) + chunk->end);
+  return true;
+}
+
+static void chunk_del(Deque *deque, DequeChunk *chunk)
+{
+  dlist_detach(&chunk->link);
+  deque->mem -= sizeof(DequeChunk) + chunk->cap;
+  free(chunk);
+}
+
+void deque_pop(Deque *deque, bool front)
+{
+  assert(!dlist_empty(&deque->chunks));
+  DequeChunk *chunk = chunk_of(front ? deque->chunks.next : deque->chunks.prev);
+  if (front)
+  {
+    std::string_view val = elem_read(chunk_data(chunk) + chunk->begin);
+    chunk->begin += (uint32_t)elem_size(val.size());
+  }
+  else
+  {
+    std::string_view val = elem_read_back(chunk_data(chunk) + chunk->end);
+    chunk->end -= (uint32_t)elem_size(val.size());
+  }
+  chunk->count--;
+  deque->count--;
+  if (chunk->count == 0)
+  {
+    chunk_del(deque, chunk);
+  }
+}
+
+void deque_range(Deque *deque, size_t start, size_t n,
+                 void (*f)(std::string_view val, void *arg), void *arg)
+{
+  assert(start + n <= deque->count);
+  DList *link = deque->chunks.next;
+  // whole chunks are skipped by their counts
+  while (n > 0 && start >= chunk_of(link)->count)
+  {
+    start -= chunk_of(link)->count;
+    link = link->next;
+  }
+  for (; n > 0; link = link->next)
+  {
+    DequeChunk *chunk = chunk_of(link);
+    uint32_t pos = chunk->begin;
+    for (uint32_t i = 0; i < chunk->count && n > 0; ++i)
+    {
+      std::string_view val = elem_read(chunk_data(chunk) + pos);
+      pos += (uint32_t)elem_size(val.size());
+      if (start > 0)
+      {
+        start--;
+        continue;
+      }
+      f(val, arg);
+      n--;
+    }
+  }
+}
+
+void deque_dispose(Deque *deque)
+{
+  while (!dlist_empty(&deque->chunks))
+  {
+    chunk_del(deque, chunk_of(deque->chunks.next));
+  }
+  deque->count = 0;
+}
+
+size_t deque_mem(Deque *deque)
+{
+  return sizeof(Deque) + deque->mem;
+}
@@ -0,0 +1,313 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+#include "hash.h"
+#include "zset.h"
+#include "common.h"
+
+static uint32_t read_u32(const char *p)
+{
+  uint32_t v = 0;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static void write_u32(char *p, uint32_t v)
+{
+  memcpy(p, &v, 4);
+}
+
+// the packed list entry of the field, or false with *pos at the end
+static bool packed_find(Hash *hash, std::string_view field, uint32_t *pos)
+{
+  uint32_t cur = 0;
+  while (cur < hash->used)
+  {
+    uint32_t flen = read_u32(hash->packed + cur);
+    if (flen == field.size() && 0 == memcmp(hash->packed + cur + 4, field.data(), flen))
+    {
+      *pos = cur;
+      return true;
+    }
+    cur += 4 + flen;
+    cur += 4 + read_u32(hash->packed + cur);
+  }
+  *pos = cur;
+  return false;
+}
+
+// room for n more bytes in the packed list
+static void packed_reserve(Hash *hash, size_t n)
+{
+  if (hash->used + n <= hash->cap)
+  {
+    return;
+  }
+  size_t cap = hash->cap ? hash->cap : 64;
+  while (cap < hash->used + n)
+  {
+    cap *= 2;
+  }
+  char *packed = (char *)realloc(hash->packed, cap);
+  if (!packed)
+  {
+    die("Out of memory");
+  }
+  hash->packed = packed;
+  hash->cap = (uint32_t)cap;
+}
+
+static void packed_set(Hash *hash, std::string_view field, std::string_view val)
+{
+  uint32_t pos = 0;
+  if (!packed_find(hash, field, &pos))
+  {
+    packed_reserve(hash, 8 + field.size() + val.size());
+    char *p = hash->packed + pos;
+    write_u32(p, (uint32_t)field.size());
+    memcpy(p + 4, field.data(), field.size());
+    write_u32(p + 4 + field.size(), (uint32_t)val.size());
+    memcpy(p + 8 + field.size(), val.data(), val.size());
+    hash->used += (uint32_t)(8 + field.size() + val.size());
+    hash->count++;
+    return;
+  }
+
+  // resize the old value in place, moving the fields after it
+  uint32_t vpos = pos + 4 + (uint32_t)field.size();
+  uint32_t vlen = read_u32(hash->packed + vpos);
+  uint32_t tail = vpos + 4 + vlen;
+  if (val.size() > vlen)
+  {
+    packed_reserve(hash, val.size() - vlen);
+  }
+  memmove(hash->packed + vpos + 4 + val.size(), hash->packed + tail, hash->used - tail);
+  hash->used = hash->used - vlen + (uint32_t)val.size();
+  write_u32(hash->packed + vpos, (uint32_t)val.size());
+  memcpy(hash->packed + vpos + 4, val.data(), val.size());
+}
+
+static size_t hfield_mem(const HField *node)
+{
+  return sizeof(HField) + node->flen + node->vlen;
+}
+
+static std::string_view hfield_name(const HField *node)
+{
+  return std::string_view((const char *)(node + 1), node->flen);
+}
+
+static std::string_view hfield_val(const HField *node)
+{
+  return std::string_view((const char *)(node + 1) + node->flen, node->vlen);
+}
+
+static HField *hfield_new(std::string_view field, uint64_t hcode, std::string_view val)
+{
+  void *mem = malloc(sizeof(HField) + field.size() + val.size());
+  if (!mem)
+  {
+    die("Out of memory");
+  }
+  HField *node = new (mem) HField();
+  node->node.hcode = hcode;
+  node->flen = (uint32_t)field.size();
+  node->vlen = (uint32_t)val.size();
+  memcpy((char *)(node + 1), field.data(), field.size());
+  memcpy((char *)(node + 1) + field.size(), val.data(), val.size());
+  return node;
+}
+
+static bool hfield_eq(HNode *node, HNode *key)
+{
+  HField *hfield = container_of(node, HField, node);
+  HKey *hkey = container_of(key, HKey, node);
+  return hfield_name(hfield) == hkey->name;
+}
+
+static void hkey_init(HKey *key, std::string_view field)
+{
+  key->node.hcode = str_hash((const uint8_t *)field.data(), field.size());
+  key->name = field;
+}
+
+static void map_set(Hash *hash, std::string_view field, std::string_view val)
+{
+  HKey key;
+  hkey_init(&key, field);
+  HNode *found = hm_lookup(&hash->hmap, &key.node, &hfield_eq);
+  if (found)
+  {
+    HField *old = container_of(found, HField, node);
+    if (old->vlen == val.size())
+    {
+      memcpy((char *)(old + 1) + old->flen, val.data(), val.size());
+      return;
+    }
+    // the value is inline, so a new size takes a new node
+    hm_pop(&hash->hmap, &key.node, &hfield_eq);
+    hash->mem -= hfield_mem(old);
+    free(old);
+    hash->count--;
+  }
+  HField *node = hfield_new(field, key.node.hcode, val);
+  hm_insert(&hash->hmap, &node->node);
+  hash->mem += hfield_mem(node);
+  hash->count++;
+}
+
+// move the packed list into the hashtable
+static void hash_convert(Hash *hash)
+{
+  uint32_t pos = 0;
+  hash->count = 0;
+  while (pos < hash->used)
+  {
+    uint32_t flen = read_u32(hash->packed + pos);
+    std::string_view field(hash->packed + pos + 4, flen);
+    pos += 4 + flen;
+    uint32_t vlen = read_u32(hash->packed + pos);
+    map_set(hash, field, std::string_view(hash->packed + pos + 4, vlen));
+    pos += 4 + vlen;
+  }
+  free(hash->packed);
+  hash->packed = NULL;
+  hash->used = hash->cap = 0;
+  hash->is_map = true;
+}
+
+bool hash_set(Hash *hash, std::string_view field, std::string_view val)
+{
+  uint32_t count = hash->count;
+  if (!hash->is_map)
+  {
+    uint32_t pos = 0;
+    bool fits = field.size() <= k_hash_packed_len && val.size() <= k_hash_packed_len;
+    if (fits && (hash->count < k_hash_packed_fields || packed_find(hash, field, &pos)))
+    {
+      packed_set(hash, field, val);
+      return hash->count > count;
+    }
+    hash_convert(hash);
+  }
+  map_set(hash, field, val);
+  return hash->count > count;
+}
+
+bool hash_get(Hash *hash, std::string_view field, std::string_view *val)
+{
+  if (!hash->is_map)
+  {
+    uint32_t pos = 0;
+    if (!packed_find(hash, field, &pos))
+    {
+      return false;
+    }
+    pos += 4 + (uint32_t)field.size();
+    *val = std::string_view(hash->packed + pos + 4, read_u32(hash->packed + pos));
+    return true;
+  }
+
+  HKey key;
+  hkey_init(&key, field);
+  HNode *found = hm_lookup(&hash->hmap, &key.node, &hfield_eq);
+  if (!found)
+  {
+    return false;
+  }
+  *val = hfield_val(container_of(found, HField, node));
+  return true;
+}
+
+bool hash_del(Hash *hash, std::string_view field)
+{
+  if (!hash->is_map)
+  {
+    uint32_t pos = 0;
+    if (!packed_find(hash, field, &pos))
+    {
+      return false;
+    }
+    uint32_t vpos = pos + 4 + (uint32_t)field.size();
+    uint32_t tail = vpos + 4 + read_u32(hash->packed + vpos);
+    memmove(hash->packed + pos, hash->packed + tail, hash->used - tail);
+    hash->used -= tail - pos;
+    hash->count--;
+    return true;
+  }
+
+  HKey key;
+  hkey_init(&key, field);
+  HNode *found = hm_pop(&hash->hmap, &key.node, &hfield_eq);
+  if (!found)
+  {
+    return false;
+  }
+  HField *node = container_of(found, HField, node);
+  hash->mem -= hfield_mem(node);
+  free(node);
+  hash->count--;
+  return true;
+}
+
+struct ForeachCtx
+{
+  void (*f)(std::string_view, std::string_view, void *);
+  void *arg;
+};
+
+static void cb_foreach(HNode *node, void *arg)
+{
+  ForeachCtx *ctx = (ForeachCtx *)arg;
+  HField *hfield = container_of(node, HField, node);
+  ctx->f(hfield_name(hfield), hfield_val(hfield), ctx->arg);
+}
+
+void hash_foreach(Hash *hash, void (*f)(std::string_view field, std::string_view val, void *arg),
+                  void *arg)
+{
+  if (hash->is_map)
+  {
+    ForeachCtx ctx = {f, arg};
+    hm_foreach(&hash->hmap, &cb_foreach, &ctx);
+    return;
+  }
+  uint32_t pos = 0;
+  while (pos < hash->used)
+  {
+    uint32_t flen = read_u32(hash->packed + pos);
+    std::string_view field(hash->packed + pos + 4, flen);
+    pos += 4 + flen;
+    uint32_t vlen = read_u32(hash->packed + pos);
+    f(field, std::string_view(hash->packed + pos + 4, vlen), arg);
+    pos += 4 + vlen;
+  }
+}
+
+static void cb_collect(HNode *node, void *arg)
+{
+  ((std::vector<HNode *> *)arg)->push_back(node);
+}
+
+void hash_dispose(Hash *hash)
+{
+  free(hash->packed);
+  // collect first, the walk reads each node's next pointer
+  std::vector<HNode *> nodes;
+  hm_foreach(&hash->hmap, &cb_collect, &nodes);
+  for (HNode *node : nodes)
+  {
+    free(container_of(node, HField, node));
+  }
+  hm_destroy(&hash->hmap);
+  *hash = Hash{};
+}
+
+size_t hash_mem(Hash *hash)
+{
+  HMapStats stats;
+  hm_stats(&hash->hmap, &stats);
+  return sizeof(Hash) + hash->cap + hash->mem + stats.bytes;
+}
@@ -1,7 +1,18 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <initializer_list>
+#include <utility>
 #include "hashtable.h"
 
+#ifndef HMAP_SWISS
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define prefetch(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define prefetch(p) __builtin_prefetch(p)
+#endif
+
 // n must be a power of 2
 static void h_init(HTab *htab, size_t n)
 {
@@ -52,10 +63,10 @@ static HNode *h_detach(HTab *htab, HNode **from)
 
 const size_t k_resizing_work = 128; // constant work
 
-static void hm_help_resizing(HMap *hmap)
+static void hm_help_resizing(HMap *hmap, size_t nwork_max = k_resizing_work)
 {
     size_t nwork = 0;
-    while (nwork < k_resizing_work && hmap->ht2.size > 0)
+    while (nwork < nwork_max && hmap->ht2.size > 0)
     {
         // scan for nodes from ht2 and move them to ht1
         HNode **from = &hmap->ht2.tab[hmap->resizing_pos];
@@ -77,12 +88,12 @@ static void hm_help_resizing(HMap *hmap)
     }
 }
 
-static void hm_start_resizing(HMap *hmap)
+// move the nodes to a new table of n buckets, bigger or smaller
+static void hm_start_resizing(HMap *hmap, size_t n)
 {
     assert(hmap->ht2.tab == NULL);
-    // create a bigger hashtable and swap them
     hmap->ht2 = hmap->ht1;
-    h_init(&hmap->ht1, (hmap->ht1.mask + 1) * 2);
+    h_init(&hmap->ht1, n);
     hmap->resizing_pos = 0;
 }
 
@@ -95,6 +106,7 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
 }
 
 const size_t k_max_load_factor = 8;
+const size_t k_min_buckets = 4;
 
 void hm_insert(HMap *hmap, HNode *node)
 {
@@ -110,24 +122,52 @@ void hm_insert(HMap *hmap, HNode *node)
         size_t load_factor = hmap->ht1.size / (hmap->ht1.mask + 1);
         if (load_factor >= k_max_load_factor)
         {
-            hm_start_resizing(hmap);
+            hm_start_resizing(hmap, (hmap->ht1.mask + 1) * 2);
         }
     }
     hm_help_resizing(hmap);
 }
 
+// shrink once the load factor drops below 1/2, to a table loaded about 2,
+// far enough from both limits that a few inserts do not grow it again
+static void hm_check_shrink(HMap *hmap)
+{
+    size_t buckets = hmap->ht1.mask + 1;
+    if (hmap->ht2.tab || buckets <= k_min_buckets || hmap->ht1.size * 2 >= buckets)
+    {
+        return;
+    }
+    size_t n = k_min_buckets;
+    while (n * 2 < hmap->ht1.size)
+    {
+        n *= 2;
+    }
+    hm_start_resizing(hmap, n);
+}
+
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
 {
     hm_help_resizing(hmap);
+    HNode *node = NULL;
     if (HNode **from = h_lookup(&hmap->ht1, key, eq))
     {
-        return h_detach(&hmap->ht1, from);
+        node = h_detach(&hmap->ht1, from);
     }
-    if (HNode **from = h_lookup(&hmap->ht2, key, eq))
+    else if (HNode **from = h_lookup(&hmap->ht2, key, eq))
     {
-        return h_detach(&hmap->ht2, from);
+        node = h_detach(&hmap->ht2, from);
     }
-    return NULL;
+    if (node && hmap->ht1.tab)
+    {
+        hm_check_shrink(hmap);
+    }
+    return node;
+}
+
+bool hm_rehash(HMap *hmap, size_t nwork)
+{
+    hm_help_resizing(hmap, nwork);
+    return hmap->ht2.tab != NULL;
 }
 
 size_t hm_size(HMap *hmap)
@@ -135,9 +175,138 @@ size_t hm_size(HMap *hmap)
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+void hm_prefetch_slot(HMap *hmap, uint64_t hcode)
+{
+    if (hmap->ht1.tab)
+    {
+        prefetch(&hmap->ht1.tab[hcode & hmap->ht1.mask]);
+    }
+    if (hmap->ht2.tab)
+    {
+        prefetch(&hmap->ht2.tab[hcode & hmap->ht2.mask]);
+    }
+}
+
+// the slot should be in cache by now, fetch the first node of its chain
+void hm_prefetch_chain(HMap *hmap, uint64_t hcode)
+{
+    if (hmap->ht1.tab)
+    {
+        if (HNode *node = hmap->ht1.tab[hcode & hmap->ht1.mask])
+        {
+            prefetch(node);
+        }
+    }
+    if (hmap->ht2.tab)
+    {
+        if (HNode *node = hmap->ht2.tab[hcode & hmap->ht2.mask])
+        {
+            prefetch(node);
+        }
+    }
+}
+
 void hm_destroy(HMap *hmap)
 {
     free(hmap->ht1.tab);
     free(hmap->ht2.tab);
     *hmap = HMap{};
 }
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg)
+{
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        for (size_t i = 0; htab->tab && i <= htab->mask; ++i)
+        {
+            for (HNode *node = htab->tab[i]; node; node = node->next)
+            {
+                f(node, arg);
+            }
+        }
+    }
+}
+
+void hm_stats(HMap *hmap, HMapStats *stats)
+{
+    stats->size = hm_size(hmap);
+    stats->buckets = hmap->ht1.tab ? hmap->ht1.mask + 1 : 0;
+    stats->rehash_buckets = hmap->ht2.tab ? hmap->ht2.mask + 1 : 0;
+    stats->rehash_pos = hmap->ht2.tab ? hmap->resizing_pos : 0;
+    stats->bytes = (stats->buckets + stats->rehash_buckets) * sizeof(HNode *);
+}
+
+const size_t k_sample_steps = 10; // buckets per wanted node
+
+size_t hm_sample(HMap *hmap, size_t pos, HNode **out, size_t n)
+{
+    size_t found = 0;
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        for (size_t i = 0; htab->size && i < n * k_sample_steps && found < n; ++i)
+        {
+            HNode *node = htab->tab[(pos + i) & htab->mask];
+            for (; node && found < n; node = node->next)
+            {
+                out[found++] = node;
+            }
+        }
+    }
+    return found;
+}
+
+static size_t rev_bits(size_t v)
+{
+    size_t r = 0;
+    for (size_t i = 0; i < sizeof(v) * 8; ++i)
+    {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+// add 1 to the bits of v above mask, counting from the top bit down
+static size_t rev_next(size_t v, size_t mask)
+{
+    v |= ~mask;
+    return rev_bits(rev_bits(v) + 1);
+}
+
+static void h_scan_bucket(HTab *htab, size_t pos, void (*f)(HNode *, void *), void *arg)
+{
+    for (HNode *node = htab->tab[pos & htab->mask]; node; node = node->next)
+    {
+        f(node, arg);
+    }
+}
+
+size_t hm_scan(HMap *hmap, size_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    if (!hmap->ht1.tab)
+    {
+        return 0;
+    }
+    if (!hmap->ht2.tab)
+    {
+        h_scan_bucket(&hmap->ht1, cursor, f, arg);
+        return rev_next(cursor, hmap->ht1.mask);
+    }
+
+    // while resizing: the bucket of the smaller table, then every bucket of
+    // the larger one whose nodes would come from it
+    HTab *small = &hmap->ht1, *large = &hmap->ht2;
+    if (small->mask > large->mask)
+    {
+        std::swap(small, large);
+    }
+    h_scan_bucket(small, cursor, f, arg);
+    do
+    {
+        h_scan_bucket(large, cursor, f, arg);
+        cursor = rev_next(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
+}
+
+#endif // HMAP_SWISS
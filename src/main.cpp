@@ -1,15 +1,116 @@
 #include "connection.h"
 #include "datastore.h"
+#include "shard.h"
+#include "slowlog.h"
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 #include <vector>
 
-int main() {
-    // Initialize the global data store
-    // Any initialization if needed
+static void usage() {
+    msg("usage: server [--io-uring] [--max-msg bytes] [--idle-timeout ms]"
+        " [--slowlog-usec n] [--slowlog-len n] [--threads n | --io-threads n]"
+        " [--maxmemory bytes] [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu]");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    bool use_uring = false;
+    long nthreads = 1;
+    bool offload = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--io-uring") == 0) {
+            use_uring = true;
+        } else if (strcmp(argv[i], "--max-msg") == 0 && i + 1 < argc) {
+            // the length prefix on the wire is 32 bits
+            long long n = atoll(argv[++i]);
+            if (n < 64 || n > 0x7fffffffLL) {
+                usage();
+            }
+            g_max_msg = (size_t)n;
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            // 0 keeps idle connections forever
+            long long ms = atoll(argv[++i]);
+            if (ms < 0 || ms > 0x7fffffffLL) {
+                usage();
+            }
+            g_idle_timeout_ms = (uint64_t)ms;
+        } else if (strcmp(argv[i], "--slowlog-usec") == 0 && i + 1 < argc) {
+            // negative disables the slowlog, 0 logs every request
+            g_slowlog_usec = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--slowlog-len") == 0 && i + 1 < argc) {
+            long long n = atoll(argv[++i]);
+            if (n < 0) {
+                usage();
+            }
+            g_slowlog_len = (size_t)n;
+        } else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+            // 0 is no limit; the limit is split evenly between the shards
+            long long n = atoll(argv[++i]);
+            if (n < 0) {
+                usage();
+            }
+            g_maxmemory = (size_t)n;
+        } else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "noeviction") == 0) {
+                g_evict_policy = EVICT_NONE;
+            } else if (strcmp(policy, "allkeys-lru") == 0) {
+                g_evict_policy = EVICT_LRU;
+            } else if (strcmp(policy, "allkeys-lfu") == 0) {
+                g_evict_policy = EVICT_LFU;
+            } else {
+                usage();
+            }
+        } else if ((strcmp(argv[i], "--threads") == 0 ||
+                    strcmp(argv[i], "--io-threads") == 0) && i + 1 < argc) {
+            offload = strcmp(argv[i], "--io-threads") == 0;
+            nthreads = atol(argv[++i]);
+            if (nthreads < 1 || nthreads > 256) {
+                usage();
+            }
+        } else {
+            usage();
+        }
+    }
 
+    if (offload) {
+        shard_init_offload((uint32_t)nthreads);
+    } else {
+        shard_init((uint32_t)nthreads);
+    }
+    if (shard_count() > 1) {
+        if (use_uring) {
+            msg("--io-uring is not supported with threads, using the readiness loop");
+        }
+        // one reactor per thread, each owning a shard of the keyspace,
+        // or with --io-threads a last thread executing all the requests
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < shard_count(); ++i) {
+            threads.emplace_back([i] {
+                shard_bind(i);
+                if (i == shard_exec_id()) {
+                    shard_exec_loop();
+                    return;
+                }
+                ConnectionManager connManager;
+                connManager.initialize();
+                connManager.run();
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        return 0;
+    }
 
     // Initialize and run the connection manager
+    shard_bind(0);
     ConnectionManager connManager;
     connManager.initialize();
+    if (use_uring && !connManager.run_uring()) {
+        msg("io_uring is unavailable, using the readiness loop");
+    }
     connManager.run();
 
     return 0;
@@ -0,0 +1,209 @@
+#include "poller.h"
+#include "protocol.h"
+#include <cassert>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+const int k_max_events = 256;
+
+static uint32_t to_epoll(uint32_t interest)
+{
+  uint32_t ev = EPOLLET | EPOLLRDHUP;
+  if (interest & POLL_IN)
+  {
+    ev |= EPOLLIN;
+  }
+  if (interest & POLL_OUT)
+  {
+    ev |= EPOLLOUT;
+  }
+  return ev;
+}
+
+Poller::Poller()
+{
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+  {
+    die("epoll_create1()");
+  }
+}
+
+Poller::~Poller()
+{
+  close(epfd);
+}
+
+void Poller::add(SOCKET fd, uint32_t interest)
+{
+  struct epoll_event ev = {};
+  ev.events = to_epoll(interest);
+  ev.data.fd = fd;
+  g_io_stats.syscalls++;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    die("epoll_ctl(ADD)");
+  }
+}
+
+void Poller::mod(SOCKET fd, uint32_t interest)
+{
+  // re-arming also reports the new condition if it is already true
+  struct epoll_event ev = {};
+  ev.events = to_epoll(interest);
+  ev.data.fd = fd;
+  g_io_stats.syscalls++;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+  {
+    die("epoll_ctl(MOD)");
+  }
+}
+
+void Poller::del(SOCKET fd)
+{
+  g_io_stats.syscalls++;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int Poller::wait(std::vector<PollEvent> &events, int timeout_ms)
+{
+  struct epoll_event evs[k_max_events];
+  int rv = 0;
+  do
+  {
+    rv = epoll_wait(epfd, evs, k_max_events, timeout_ms);
+    g_io_stats.syscalls++;
+  } while (rv < 0 && errno == EINTR);
+  if (rv < 0)
+  {
+    die("epoll_wait()");
+  }
+
+  events.clear();
+  for (int i = 0; i < rv; ++i)
+  {
+    PollEvent pe;
+    pe.fd = evs[i].data.fd;
+    if (evs[i].events & EPOLLIN)
+    {
+      pe.events |= POLL_IN;
+    }
+    if (evs[i].events & EPOLLOUT)
+    {
+      pe.events |= POLL_OUT;
+    }
+    if (evs[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+      pe.events |= POLL_ERR;
+    }
+    events.push_back(pe);
+  }
+  return rv;
+}
+
+#else // select() fallback
+
+Poller::Poller() {}
+
+Poller::~Poller() {}
+
+void Poller::add(SOCKET fd, uint32_t interest)
+{
+  watches.push_back(Watch{fd, interest});
+}
+
+void Poller::mod(SOCKET fd, uint32_t interest)
+{
+  for (Watch &w : watches)
+  {
+    if (w.fd == fd)
+    {
+      w.interest = interest;
+      return;
+    }
+  }
+  assert(!"mod() on an unknown fd");
+}
+
+void Poller::del(SOCKET fd)
+{
+  for (size_t i = 0; i < watches.size(); ++i)
+  {
+    if (watches[i].fd == fd)
+    {
+      watches[i] = watches.back();
+      watches.pop_back();
+      return;
+    }
+  }
+}
+
+int Poller::wait(std::vector<PollEvent> &events, int timeout_ms)
+{
+  fd_set read_fds, write_fds, except_fds;
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+  FD_ZERO(&except_fds);
+
+  SOCKET max_fd = 0;
+  for (const Watch &w : watches)
+  {
+    if (w.interest & POLL_IN)
+    {
+      FD_SET(w.fd, &read_fds);
+    }
+    if (w.interest & POLL_OUT)
+    {
+      FD_SET(w.fd, &write_fds);
+    }
+    FD_SET(w.fd, &except_fds);
+    if (w.fd > max_fd)
+    {
+      max_fd = w.fd;
+    }
+  }
+
+  struct timeval tv = {};
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  int rv = select((int)max_fd + 1, &read_fds, &write_fds, &except_fds,
+                  timeout_ms < 0 ? NULL : &tv);
+  g_io_stats.syscalls++;
+  if (rv == SOCKET_ERROR)
+  {
+    if (net_interrupted(net_errno()))
+    {
+      events.clear();
+      return 0;
+    }
+    die("select");
+  }
+
+  events.clear();
+  for (const Watch &w : watches)
+  {
+    PollEvent pe;
+    pe.fd = w.fd;
+    if (FD_ISSET(w.fd, &read_fds))
+    {
+      pe.events |= POLL_IN;
+    }
+    if (FD_ISSET(w.fd, &write_fds))
+    {
+      pe.events |= POLL_OUT;
+    }
+    if (FD_ISSET(w.fd, &except_fds))
+    {
+      pe.events |= POLL_ERR;
+    }
+    if (pe.events)
+    {
+      events.push_back(pe);
+    }
+  }
+  return (int)events.size();
+}
+
+#endif
@@ -2,19 +2,24 @@
 #include "commands.h"
 #include "connection.h"
 #include "datastore.h"
+#include "shard.h"
 #include <cassert>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 #include <vector>
 #include <string>
+#include <string_view>
 // Assuming other necessary includes and using directives
 
 const size_t k_max_args = 4096;
 
+size_t g_max_msg = k_default_max_msg;
+
 // Implementation of request parsing and response generation
 
-static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out)
+// the arguments are views into the read buffer, nothing is copied
+static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string_view> &out)
 {
   if (len < 4)
   {
@@ -51,81 +56,188 @@ static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::strin
   return 0;
 }
 
-bool try_one_request(Conn *conn)
+// parse the request at rbuf[pos], appending its arguments to `out`.
+// returns false if there is no complete request (or on a protocol error).
+static bool next_request(Conn *conn, size_t pos, std::uint32_t *len,
+                         std::vector<std::string_view> &out)
 {
-  // try to parse a request from the buffer
-  if (conn->rbuf_size < 4)
+  const uint8_t *data = &conn->rbuf.data[pos];
+  size_t avail = conn->rbuf.size - pos;
+  if (avail < 4)
   {
     // not enough data in the buffer. Will retry in the next iteration
     return false;
   }
-  std::uint32_t len = 0;
-  memcpy(&len, &conn->rbuf[0], 4);
-  if (len > k_max_msg)
+  memcpy(len, &data[0], 4);
+  if (*len > g_max_msg)
   {
     msg("too long");
     conn->state = STATE_END;
     return false;
   }
-  if (len + 4 > conn->rbuf_size)
+  if (*len + 4 > avail)
   {
     // not enough data in the buffer. Will retry in the next iteration
     return false;
   }
-
-  // parse the request
-  std::vector<std::string> cmd;
-  if (0 != parse_req(&conn->rbuf[4], len, cmd))
+  if (0 != parse_req(&data[4], *len, out))
   {
     msg("bad req");
     conn->state = STATE_END;
     return false;
   }
+  return true;
+}
 
-  // got one request, generate the response.
-  std::string out;
-  do_request(cmd, out);
+void exec_request(std::vector<std::string_view> &cmd, Buffer &out, SOCKET client)
+{
+  // encode the response straight into the output behind a placeholder
+  // for its length prefix
+  size_t hdr = out.size;
+  std::uint32_t wlen = 0;
+  buf_append(&out, &wlen, 4);
+  do_request(cmd, out, client);
 
-  // pack the response into the buffer
-  if (4 + out.size() > k_max_msg)
+  if (out.size - hdr - 4 > g_max_msg)
   {
-    out.clear();
+    out.size = hdr + 4;
     out_err(out, ERR_2BIG, "response is too big");
   }
+  wlen = (std::uint32_t)(out.size - hdr - 4);
+  memcpy(&out.data[hdr], &wlen, 4);
+}
+
+// parse the request at rbuf[*pos] and queue its response.
+// returns false if there is no complete request (or on a protocol error).
+static bool process_one_request(Conn *conn, size_t *pos)
+{
+  std::vector<std::string_view> &cmd = conn->args;
+  cmd.clear();
+  std::uint32_t len = 0;
+  if (!next_request(conn, *pos, &len, cmd))
+  {
+    return false;
+  }
+  g_io_stats.requests++;
+
+  const uint8_t *body = &conn->rbuf.data[*pos + 4];
+  *pos += 4 + len;
+  if (shard_count() > 1 && shard_forward(conn, cmd, body, len))
+  {
+    // the rest of the pipeline waits for the reply to keep the order
+    return false;
+  }
+
+  // got one request
+  exec_request(cmd, conn->wbuf, conn->fd);
+  return true;
+}
+
+// I/O threads mode: parse every complete request and hand the batch to the
+// execution thread, together with the read buffer the arguments point into
+static bool offload_requests(Conn *conn)
+{
+  if (conn->shard_wait)
+  {
+    return conn->state != STATE_END;
+  }
+  ShardMsg *batch = new ShardMsg();
+  size_t pos = 0;
+  std::uint32_t len = 0;
+  size_t nargs = 0;
+  while (next_request(conn, pos, &len, batch->args))
+  {
+    batch->argc.push_back((std::uint32_t)(batch->args.size() - nargs));
+    nargs = batch->args.size();
+    pos += 4 + len;
+  }
+  if (batch->argc.empty() || conn->state == STATE_END)
+  {
+    delete batch;
+    return false;
+  }
+  g_io_stats.requests += batch->argc.size();
 
-  std::uint32_t wlen = (std::uint32_t)out.size();
-  memcpy(&conn->wbuf[0], &wlen, 4);
-  memcpy(&conn->wbuf[4], out.data(), out.size());
-  conn->wbuf_size = 4 + wlen;
+  // the leftover partial request moves to a fresh buffer
+  std::swap(batch->rbuf, conn->rbuf);
+  if (pos < batch->rbuf.size)
+  {
+    buf_append(&conn->rbuf, &batch->rbuf.data[pos], batch->rbuf.size - pos);
+  }
+  shard_offload(conn, batch);
+  return true;
+}
 
-  size_t remain = conn->rbuf_size - 4 - len;
-  if (remain)
+size_t rbuf_want(Conn *conn)
+{
+  // enough for the rest of a large message in one go
+  size_t want = k_read_chunk;
+  if (conn->rbuf.size >= 4)
   {
-    memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+    std::uint32_t len = 0;
+    memcpy(&len, conn->rbuf.data, 4);
+    if (len <= g_max_msg && 4 + len > conn->rbuf.size + want)
+    {
+      want = 4 + len - conn->rbuf.size;
+    }
   }
-  conn->rbuf_size = remain;
+  return want;
+}
 
-  // change state
-  conn->state = STATE_RES;
-  state_res(conn);
+bool process_requests(Conn *conn)
+{
+  if (shard_exec_id() != k_no_shard)
+  {
+    return offload_requests(conn);
+  }
+  size_t pos = 0;
+  bool queued = false;
+  while (!conn->shard_wait && conn->wbuf.size < k_wbuf_high_water &&
+         process_one_request(conn, &pos))
+  {
+    queued = true;
+  }
 
-  // continue the outer loop if the request was fully processed
-  return (conn->state == STATE_REQ);
+  // drop the consumed requests with a single move
+  buf_consume(&conn->rbuf, pos);
+  if (conn->rbuf.size == 0)
+  {
+    // nothing pending, an idle connection keeps no read buffer
+    buf_release(&conn->rbuf);
+  }
+  return (queued || conn->shard_wait) && conn->state != STATE_END;
+}
+
+bool try_requests(Conn *conn)
+{
+  // all the queued responses go out together
+  while (conn->state == STATE_REQ && process_requests(conn))
+  {
+    if (conn->wbuf.size == 0)
+    {
+      break; // only a forwarded request, nothing to send yet
+    }
+    conn->state = STATE_RES;
+    state_res(conn);
+  }
+  // a connection waiting on another shard reads nothing more until resumed
+  return conn->state == STATE_REQ && !conn->shard_wait;
 }
 
 bool try_fill_buffer(Conn *conn)
 {
   // try to fill the buffer
-  assert(conn->rbuf_size < sizeof(conn->rbuf));
+  buf_reserve(&conn->rbuf, rbuf_want(conn));
   int rv = 0;
   do
   {
-    size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-    rv = recv(conn->fd, (char *)&conn->rbuf[conn->rbuf_size], (int)cap, 0);
-  } while (rv < 0 && WSAGetLastError() == WSAEINTR);
-  if (rv < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+    size_t cap = conn->rbuf.cap - conn->rbuf.size;
+    rv = recv(conn->fd, (char *)&conn->rbuf.data[conn->rbuf.size], (int)cap, 0);
+    g_io_stats.syscalls++;
+  } while (rv < 0 && net_interrupted(net_errno()));
+  if (rv < 0 && net_would_block(net_errno()))
   {
-    // got WSAEWOULDBLOCK, stop.
+    // got EWOULDBLOCK, stop.
     return false;
   }
   if (rv < 0)
@@ -136,7 +248,7 @@ bool try_fill_buffer(Conn *conn)
   }
   if (rv == 0)
   {
-    if (conn->rbuf_size > 0)
+    if (conn->rbuf.size > 0)
     {
       msg("unexpected EOF");
     }
@@ -148,14 +260,11 @@ bool try_fill_buffer(Conn *conn)
     return false;
   }
 
-  conn->rbuf_size += (size_t)rv;
-  assert(conn->rbuf_size <= sizeof(conn->rbuf));
+  conn->rbuf.size += (size_t)rv;
+  g_io_stats.bytes_in += (size_t)rv;
+  assert(conn->rbuf.size <= conn->rbuf.cap);
 
-  while (try_one_request(conn))
-  {
-    // Continue processing
-  }
-  return (conn->state == STATE_REQ);
+  return try_requests(conn);
 }
 
 void state_req(Conn *conn)
@@ -171,12 +280,13 @@ bool try_flush_buffer(Conn *conn)
   int rv = 0;
   do
   {
-    size_t remain = conn->wbuf_size - conn->wbuf_sent;
-    rv = send(conn->fd, (char *)&conn->wbuf[conn->wbuf_sent], (int)remain, 0);
-  } while (rv < 0 && WSAGetLastError() == WSAEINTR);
-  if (rv < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+    size_t remain = conn->wbuf.size - conn->wbuf_sent;
+    rv = send(conn->fd, (char *)&conn->wbuf.data[conn->wbuf_sent], (int)remain, 0);
+    g_io_stats.syscalls++;
+  } while (rv < 0 && net_interrupted(net_errno()));
+  if (rv < 0 && net_would_block(net_errno()))
   {
-    // got WSAEWOULDBLOCK, stop.
+    // got EWOULDBLOCK, stop.
     return false;
   }
   if (rv < 0)
@@ -186,13 +296,14 @@ bool try_flush_buffer(Conn *conn)
     return false;
   }
   conn->wbuf_sent += (size_t)rv;
-  assert(conn->wbuf_sent <= conn->wbuf_size);
-  if (conn->wbuf_sent == conn->wbuf_size)
+  g_io_stats.bytes_out += (size_t)rv;
+  assert(conn->wbuf_sent <= conn->wbuf.size);
+  if (conn->wbuf_sent == conn->wbuf.size)
   {
-    // response was fully sent, change state back
+    // responses were fully sent, change state back
     conn->state = STATE_REQ;
     conn->wbuf_sent = 0;
-    conn->wbuf_size = 0;
+    buf_release(&conn->wbuf);
     return false;
   }
   // still got some data in wbuf, could try to write again
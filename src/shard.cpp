@@ -0,0 +1,542 @@
+#include "shard.h"
+#include "commands.h"
+#include "connection.h"
+#include "poller.h"
+#include "protocol.h"
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <memory>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+const size_t k_queue_len = 4096;
+
+typedef SpscQueue<ShardMsg *, k_queue_len> ShardQueue;
+
+struct ShardMesh
+{
+  uint32_t n = 1;
+  uint32_t exec = k_no_shard;
+  // queues[from * n + to]
+  std::vector<std::unique_ptr<ShardQueue>> queues;
+  std::vector<int> wake_fds;
+};
+
+static ShardMesh g_mesh;
+
+// per reactor thread
+static thread_local uint32_t t_shard = 0;
+static thread_local std::vector<std::deque<ShardMsg *>> t_outbox;
+static thread_local uint32_t t_next_inbox = 0;
+
+void shard_init(uint32_t n)
+{
+#ifndef __linux__
+  if (n > 1)
+  {
+    msg("sharding needs Linux, running a single reactor");
+    n = 1;
+  }
+#endif
+  g_mesh.n = n;
+  for (uint32_t i = 0; i < n * n; ++i)
+  {
+    g_mesh.queues.emplace_back(new ShardQueue());
+  }
+#ifdef __linux__
+  for (uint32_t i = 0; i < n && n > 1; ++i)
+  {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+    {
+      die("eventfd()");
+    }
+    g_mesh.wake_fds.push_back(fd);
+  }
+#endif
+}
+
+void shard_init_offload(uint32_t nio)
+{
+  shard_init(nio + 1);
+  if (g_mesh.n > 1)
+  {
+    g_mesh.exec = nio;
+  }
+}
+
+uint32_t shard_exec_id()
+{
+  return g_mesh.exec;
+}
+
+uint32_t shard_count()
+{
+  return g_mesh.n;
+}
+
+void shard_bind(uint32_t id)
+{
+  assert(id < g_mesh.n);
+  t_shard = id;
+  t_outbox.resize(g_mesh.n);
+}
+
+uint32_t shard_self()
+{
+  return t_shard;
+}
+
+uint32_t shard_key_owners()
+{
+  return g_mesh.exec == k_no_shard ? g_mesh.n : 1;
+}
+
+uint32_t shard_of(std::string_view key)
+{
+  // the high half, the low bits pick the hashtable slot inside the shard
+  uint64_t h = str_hash((const uint8_t *)key.data(), key.size());
+  return (uint32_t)((h >> 32) % g_mesh.n);
+}
+
+static ShardMsg *msg_new(Conn *conn, const uint8_t *body, size_t len)
+{
+  ShardMsg *m = new ShardMsg();
+  m->from = t_shard;
+  m->conn = conn;
+  m->client = conn->fd;
+  m->req.assign((const char *)body, len);
+  return m;
+}
+
+// a request body for a sub-command built from views
+static ShardMsg *msg_new(Conn *conn, const std::vector<std::string_view> &cmd)
+{
+  ShardMsg *m = msg_new(conn, NULL, 0);
+  std::uint32_t n = (std::uint32_t)cmd.size();
+  m->req.append((const char *)&n, 4);
+  for (std::string_view arg : cmd)
+  {
+    std::uint32_t sz = (std::uint32_t)arg.size();
+    m->req.append((const char *)&sz, 4);
+    m->req.append(arg.data(), arg.size());
+  }
+  return m;
+}
+
+// run our own part of a request now, it joins the parts from other shards
+static void run_local_part(Conn *conn, std::vector<std::string_view> &cmd,
+                           std::vector<uint32_t> &&pos)
+{
+  ShardMsg *m = new ShardMsg();
+  m->pos = std::move(pos);
+  do_request(cmd, m->reply, conn->fd);
+  conn->shard_parts.push_back(m);
+}
+
+// split a multi-key command by the owners of its keys
+static bool forward_multi(Conn *conn, std::vector<std::string_view> &cmd,
+                          const uint8_t *body, size_t len)
+{
+  size_t step = cmd_lookup(cmd[0])->key_step;
+  size_t nkeys = (cmd.size() - 1) / step;
+  std::vector<uint32_t> owner(nkeys);
+  bool single = true;
+  for (size_t k = 0; k < nkeys; ++k)
+  {
+    owner[k] = shard_of(cmd[1 + k * step]);
+    single = single && owner[k] == owner[0];
+  }
+  if (single)
+  {
+    // the common case, forwarded whole like a single-key command
+    if (owner[0] == t_shard)
+    {
+      return false;
+    }
+    shard_send(owner[0], msg_new(conn, body, len));
+    conn->shard_wait = 1;
+    return true;
+  }
+
+  std::vector<std::string_view> sub;
+  for (uint32_t s = 0; s < g_mesh.n; ++s)
+  {
+    sub.assign(1, cmd[0]);
+    std::vector<uint32_t> pos;
+    for (size_t k = 0; k < nkeys; ++k)
+    {
+      if (owner[k] == s)
+      {
+        sub.insert(sub.end(), cmd.begin() + 1 + k * step, cmd.begin() + 1 + (k + 1) * step);
+        pos.push_back((uint32_t)k);
+      }
+    }
+    if (pos.empty())
+    {
+      continue;
+    }
+    if (s == t_shard)
+    {
+      run_local_part(conn, sub, std::move(pos));
+      continue;
+    }
+    ShardMsg *m = msg_new(conn, sub);
+    m->pos = std::move(pos);
+    shard_send(s, m);
+    conn->shard_wait++;
+  }
+  return true;
+}
+
+bool shard_forward(Conn *conn, std::vector<std::string_view> &cmd,
+                   const uint8_t *body, size_t len)
+{
+  switch (cmd_route(cmd))
+  {
+  case ROUTE_KEY:
+  case ROUTE_SUBKEY:
+  {
+    uint32_t owner = shard_of(cmd[cmd_route(cmd) == ROUTE_KEY ? 1 : 2]);
+    if (owner == t_shard)
+    {
+      return false;
+    }
+    shard_send(owner, msg_new(conn, body, len));
+    conn->shard_wait = 1;
+    return true;
+  }
+  case ROUTE_ALL:
+    run_local_part(conn, cmd, {});
+    for (uint32_t i = 0; i < g_mesh.n; ++i)
+    {
+      if (i != t_shard)
+      {
+        shard_send(i, msg_new(conn, body, len));
+        conn->shard_wait++;
+      }
+    }
+    return true;
+  case ROUTE_MULTI:
+    return forward_multi(conn, cmd, body, len);
+  case ROUTE_CURSOR:
+  {
+    int64_t cursor = 0;
+    if (!str2int(cmd[1], cursor) || cursor < 0)
+    {
+      return false; // the error comes from the local shard
+    }
+    uint32_t owner = (uint32_t)((uint64_t)cursor % g_mesh.n);
+    if (owner == t_shard)
+    {
+      return false;
+    }
+    shard_send(owner, msg_new(conn, body, len));
+    conn->shard_wait = 1;
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+void shard_offload(Conn *conn, ShardMsg *batch)
+{
+  batch->from = t_shard;
+  batch->conn = conn;
+  batch->client = conn->fd;
+  shard_send(g_mesh.exec, batch);
+  conn->shard_wait = 1;
+}
+
+// the encoded size of a scalar value at p
+static size_t ser_scalar_len(const uint8_t *p)
+{
+  std::uint32_t len = 0;
+  switch (p[0])
+  {
+  case SER_NIL:
+    return 1;
+  case SER_ERR:
+    memcpy(&len, &p[5], 4);
+    return 1 + 4 + 4 + len;
+  case SER_STR:
+    memcpy(&len, &p[1], 4);
+    return 1 + 4 + len;
+  case SER_INT:
+  case SER_DBL:
+    return 1 + 8;
+  default:
+    assert(!"not a scalar");
+    return 0;
+  }
+}
+
+// combine the parts of a fanned out or split request into one reply
+static void gather_reply(Conn *conn, Buffer &out)
+{
+  std::vector<ShardMsg *> &parts = conn->shard_parts;
+  for (ShardMsg *m : parts)
+  {
+    if (m->reply.data[0] == SER_ERR)
+    {
+      std::swap(out, m->reply); // any error fails the whole request
+      return;
+    }
+  }
+  if (parts.size() == 1)
+  {
+    std::swap(out, parts[0]->reply);
+    return;
+  }
+
+  uint8_t type = parts[0]->reply.data[0];
+  if (type == SER_INT)
+  {
+    // counts, e.g. DEL: add them up
+    int64_t sum = 0;
+    for (ShardMsg *m : parts)
+    {
+      int64_t v = 0;
+      memcpy(&v, &m->reply.data[1], 8);
+      sum += v;
+    }
+    out_int(out, sum);
+  }
+  else if (type == SER_ARR && !parts[0]->pos.empty())
+  {
+    // one element per key, e.g. MGET: back to the order of the keys
+    std::vector<std::string_view> elems;
+    for (ShardMsg *m : parts)
+    {
+      size_t off = 5;
+      for (uint32_t k : m->pos)
+      {
+        if (elems.size() <= k)
+        {
+          elems.resize(k + 1);
+        }
+        size_t n = ser_scalar_len(&m->reply.data[off]);
+        elems[k] = std::string_view((const char *)&m->reply.data[off], n);
+        off += n;
+      }
+    }
+    out_arr(out, (std::uint32_t)elems.size());
+    for (std::string_view e : elems)
+    {
+      buf_append(&out, e.data(), e.size());
+    }
+  }
+  else if (type == SER_ARR)
+  {
+    // fan-out, e.g. KEYS: concatenate the elements
+    size_t arr = begin_arr(out);
+    std::uint32_t total = 0;
+    for (ShardMsg *m : parts)
+    {
+      std::uint32_t n = 0;
+      memcpy(&n, &m->reply.data[1], 4);
+      total += n;
+      buf_append(&out, &m->reply.data[5], m->reply.size - 5);
+    }
+    end_arr(out, arr, total);
+  }
+  else
+  {
+    // the same reply from everyone, e.g. MSET
+    std::swap(out, parts[0]->reply);
+  }
+}
+
+void shard_parts_free(Conn *conn)
+{
+  for (ShardMsg *m : conn->shard_parts)
+  {
+    buf_release(&m->reply);
+    delete m;
+  }
+  conn->shard_parts.clear();
+}
+
+bool shard_merge_reply(Conn *conn, ShardMsg *msg)
+{
+  assert(conn->shard_wait > 0);
+  if (!msg->argc.empty())
+  {
+    // a batch reply is already framed, the request buffer can go too
+    buf_release(&msg->rbuf);
+    if (conn->wbuf.size == 0)
+    {
+      std::swap(conn->wbuf, msg->reply);
+    }
+    else
+    {
+      buf_append(&conn->wbuf, msg->reply.data, msg->reply.size);
+    }
+    buf_release(&msg->reply);
+    delete msg;
+    conn->shard_wait = 0;
+    return true;
+  }
+
+  conn->shard_parts.push_back(msg);
+  if (--conn->shard_wait > 0)
+  {
+    return false;
+  }
+
+  // the combined result goes out with a length prefix
+  Buffer res;
+  gather_reply(conn, res);
+  shard_parts_free(conn);
+  std::uint32_t wlen = (std::uint32_t)res.size;
+  if (res.size > g_max_msg)
+  {
+    res.size = 0;
+    out_err(res, ERR_2BIG, "response is too big");
+    wlen = (std::uint32_t)res.size;
+  }
+  buf_append(&conn->wbuf, &wlen, 4);
+  buf_append(&conn->wbuf, res.data, res.size);
+  buf_release(&res);
+  return true;
+}
+
+void shard_execute(ShardMsg *msg)
+{
+  if (!msg->argc.empty())
+  {
+    std::vector<std::string_view> cmd;
+    size_t arg = 0;
+    for (uint32_t n : msg->argc)
+    {
+      cmd.assign(msg->args.begin() + arg, msg->args.begin() + arg + n);
+      arg += n;
+      exec_request(cmd, msg->reply, msg->client);
+    }
+  }
+  else
+  {
+    // the body was validated by the sending shard
+    std::vector<std::string_view> cmd;
+    const uint8_t *data = (const uint8_t *)msg->req.data();
+    std::uint32_t n = 0;
+    memcpy(&n, data, 4);
+    size_t pos = 4;
+    while (n--)
+    {
+      std::uint32_t sz = 0;
+      memcpy(&sz, &data[pos], 4);
+      cmd.emplace_back((const char *)&data[pos + 4], sz);
+      pos += 4 + sz;
+    }
+    do_request(cmd, msg->reply, msg->client);
+  }
+  msg->is_reply = true;
+  shard_send(msg->from, msg);
+}
+
+void shard_exec_loop()
+{
+  Poller poller;
+  poller.add(shard_wake_fd(), POLL_IN);
+  std::vector<PollEvent> events;
+  bool backlog = false;
+  bool db_busy = false;
+  while (true)
+  {
+    int timeout_ms = db_next_timer_ms();
+    if (db_busy)
+    {
+      timeout_ms = 0;
+    }
+    else if (backlog && timeout_ms != 0)
+    {
+      timeout_ms = 1;
+    }
+    poller.wait(events, timeout_ms);
+    shard_wake_ack();
+    while (ShardMsg *msg = shard_recv())
+    {
+      shard_execute(msg);
+    }
+    backlog = shard_flush();
+    bool expiring = db_expire(k_expire_usec);
+    db_busy = db_rehash(events.empty() ? k_idle_rehash_usec : 0) || expiring;
+    db_publish_stats();
+  }
+}
+
+void shard_send(uint32_t to, ShardMsg *msg)
+{
+  assert(to != t_shard);
+  t_outbox[to].push_back(msg);
+}
+
+bool shard_flush()
+{
+  bool pending = false;
+  for (uint32_t to = 0; to < g_mesh.n; ++to)
+  {
+    std::deque<ShardMsg *> &out = t_outbox[to];
+    if (out.empty())
+    {
+      continue;
+    }
+    ShardQueue *q = g_mesh.queues[t_shard * g_mesh.n + to].get();
+    size_t pushed = 0;
+    while (!out.empty() && q->push(out.front()))
+    {
+      out.pop_front();
+      pushed++;
+    }
+    pending = pending || !out.empty();
+#ifdef __linux__
+    if (pushed)
+    {
+      // one wakeup per receiver and loop iteration
+      uint64_t one = 1;
+      ssize_t rv = write(g_mesh.wake_fds[to], &one, sizeof(one));
+      (void)rv; // EAGAIN means the counter is already non-zero
+      g_io_stats.syscalls++;
+    }
+#endif
+  }
+  return pending;
+}
+
+SOCKET shard_wake_fd()
+{
+  return g_mesh.wake_fds.empty() ? INVALID_SOCKET : g_mesh.wake_fds[t_shard];
+}
+
+void shard_wake_ack()
+{
+#ifdef __linux__
+  uint64_t val = 0;
+  ssize_t rv = read(g_mesh.wake_fds[t_shard], &val, sizeof(val));
+  (void)rv;
+  g_io_stats.syscalls++;
+#endif
+}
+
+ShardMsg *shard_recv()
+{
+  for (uint32_t i = 0; i < g_mesh.n; ++i)
+  {
+    uint32_t from = t_next_inbox;
+    t_next_inbox = (t_next_inbox + 1) % g_mesh.n;
+    if (from == t_shard)
+    {
+      continue;
+    }
+    ShardMsg *msg = nullptr;
+    if (g_mesh.queues[from * g_mesh.n + t_shard]->pop(msg))
+    {
+      return msg;
+    }
+  }
+  return NULL;
+}
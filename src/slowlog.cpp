@@ -0,0 +1,130 @@
+#include "slowlog.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include "commands.h"
+#include "datastore.h"
+
+// the arguments of an entry are cut down to this
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+
+int64_t g_slowlog_usec = 10 * 1000;
+size_t g_slowlog_len = 128;
+
+struct SlowEntry
+{
+  uint64_t id = 0;
+  int64_t timestamp = 0; // unix time in seconds
+  uint64_t usec = 0;
+  std::vector<std::string> args;
+  int64_t client = -1;
+};
+
+static struct
+{
+  std::mutex mu;
+  std::deque<SlowEntry> entries; // the newest first
+  uint64_t next_id = 0;
+} g_slowlog;
+
+static std::string truncated(std::string_view arg)
+{
+  if (arg.size() <= k_slowlog_max_arg_len)
+  {
+    return std::string(arg);
+  }
+  std::string s(arg.substr(0, k_slowlog_max_arg_len));
+  s += "... (" + std::to_string(arg.size() - k_slowlog_max_arg_len) + " more bytes)";
+  return s;
+}
+
+void slowlog_record(const std::vector<std::string_view> &cmd, uint64_t usec, SOCKET client)
+{
+  if (g_slowlog_usec < 0 || usec < (uint64_t)g_slowlog_usec)
+  {
+    return;
+  }
+
+  // build the entry outside the lock
+  SlowEntry ent;
+  ent.timestamp = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+  ent.usec = usec;
+  ent.client = client == INVALID_SOCKET ? -1 : (int64_t)client;
+  size_t nargs = cmd.size();
+  if (nargs > k_slowlog_max_args)
+  {
+    // the last slot says how many are missing
+    nargs = k_slowlog_max_args - 1;
+  }
+  for (size_t i = 0; i < nargs; ++i)
+  {
+    ent.args.push_back(truncated(cmd[i]));
+  }
+  if (nargs < cmd.size())
+  {
+    ent.args.push_back("... (" + std::to_string(cmd.size() - nargs) + " more arguments)");
+  }
+
+  std::lock_guard<std::mutex> lock(g_slowlog.mu);
+  ent.id = g_slowlog.next_id++;
+  g_slowlog.entries.push_front(std::move(ent));
+  while (g_slowlog.entries.size() > g_slowlog_len)
+  {
+    g_slowlog.entries.pop_back();
+  }
+}
+
+// each entry is an array: id, timestamp, duration in usec, arguments, client fd
+static void out_entry(Buffer &out, const SlowEntry &ent)
+{
+  out_arr(out, 5);
+  out_int(out, (int64_t)ent.id);
+  out_int(out, ent.timestamp);
+  out_int(out, (int64_t)ent.usec);
+  out_arr(out, (uint32_t)ent.args.size());
+  for (const std::string &arg : ent.args)
+  {
+    out_str(out, arg);
+  }
+  out_int(out, ent.client);
+}
+
+void do_slowlog(std::vector<std::string_view> &cmd, Buffer &out)
+{
+  std::string_view sub = cmd[1];
+  if (cmd.size() <= 3 && cmd_is(sub, "get"))
+  {
+    int64_t count = 10;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0))
+    {
+      return out_err(out, ERR_ARG, "expect a non-negative count");
+    }
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    size_t n = std::min((size_t)count, g_slowlog.entries.size());
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      out_entry(out, g_slowlog.entries[i]);
+    }
+  }
+  else if (cmd.size() == 2 && cmd_is(sub, "len"))
+  {
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    out_int(out, (int64_t)g_slowlog.entries.size());
+  }
+  else if (cmd.size() == 2 && cmd_is(sub, "reset"))
+  {
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    g_slowlog.entries.clear();
+    out_nil(out);
+  }
+  else
+  {
+    out_err(out, ERR_ARG, "expect SLOWLOG GET [count] | LEN | RESET");
+  }
+}
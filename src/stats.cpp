@@ -0,0 +1,193 @@
+#include "stats.h"
+#include <algorithm>
+#include <cassert>
+#include <mutex>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+thread_local IOStats g_io_stats;
+thread_local CmdStatsTable g_cmd_stats;
+thread_local DbStats g_db_stats;
+
+// the stats of the live threads
+static std::mutex g_stats_mu;
+static std::vector<const IOStats *> g_io_all;
+static std::vector<const CmdStatsTable *> g_cmd_all;
+static std::vector<const DbStats *> g_db_all;
+
+template <typename T>
+static void unregister(std::vector<const T *> &all, const T *p)
+{
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  all.erase(std::remove(all.begin(), all.end(), p), all.end());
+}
+
+IOStats::IOStats()
+{
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  g_io_all.push_back(this);
+}
+
+IOStats::~IOStats()
+{
+  unregister(g_io_all, this);
+}
+
+CmdStatsTable::CmdStatsTable()
+{
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  g_cmd_all.push_back(this);
+}
+
+CmdStatsTable::~CmdStatsTable()
+{
+  unregister(g_cmd_all, this);
+}
+
+DbStats::DbStats()
+{
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  g_db_all.push_back(this);
+}
+
+DbStats::~DbStats()
+{
+  unregister(g_db_all, this);
+}
+
+IOTotals io_stats_total()
+{
+  IOTotals t;
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  for (const IOStats *s : g_io_all)
+  {
+    t.loops += s->loops.get();
+    t.events += s->events.get();
+    t.accepted += s->accepted.get();
+    t.conns += s->conns.get();
+    t.syscalls += s->syscalls.get();
+    t.requests += s->requests.get();
+    t.bytes_in += s->bytes_in.get();
+    t.bytes_out += s->bytes_out.get();
+  }
+  return t;
+}
+
+DbTotals db_stats_total()
+{
+  DbTotals t;
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  for (const DbStats *s : g_db_all)
+  {
+    t.keys += s->keys.get();
+    t.buckets += s->buckets.get();
+    t.rehash_buckets += s->rehash_buckets.get();
+    t.rehash_pos += s->rehash_pos.get();
+    t.expires += s->expires.get();
+    t.used_memory += s->used_memory.get();
+    t.evicted += s->evicted.get();
+  }
+  return t;
+}
+
+CmdTotals cmd_stats_total(uint32_t id)
+{
+  assert(id < k_max_commands);
+  CmdTotals t;
+  std::lock_guard<std::mutex> lock(g_stats_mu);
+  for (const CmdStatsTable *table : g_cmd_all)
+  {
+    const CmdStats &s = table->cmds[id];
+    t.calls += s.calls.get();
+    t.arity_errors += s.arity_errors.get();
+    hist_merge(&t.latency, &s.latency);
+  }
+  return t;
+}
+
+static uint32_t msb64(uint64_t val)
+{
+#ifdef _MSC_VER
+  unsigned long idx = 0;
+  _BitScanReverse64(&idx, val);
+  return (uint32_t)idx;
+#else
+  return 63 - (uint32_t)__builtin_clzll(val);
+#endif
+}
+
+static uint32_t hist_bucket(uint64_t val)
+{
+  if (val >> k_hist_max_bits)
+  {
+    return k_hist_buckets - 1;
+  }
+  if (val < (1u << k_hist_sub_bits))
+  {
+    return (uint32_t)val;
+  }
+  uint32_t msb = msb64(val);
+  uint32_t shift = msb - k_hist_sub_bits;
+  uint32_t sub = (uint32_t)(val >> shift) & ((1u << k_hist_sub_bits) - 1);
+  return ((shift + 1) << k_hist_sub_bits) + sub;
+}
+
+// the largest value that lands in the bucket
+static uint64_t hist_bucket_max(uint32_t b)
+{
+  uint32_t sub = b & ((1u << k_hist_sub_bits) - 1);
+  uint32_t group = b >> k_hist_sub_bits;
+  if (group == 0)
+  {
+    return sub;
+  }
+  uint32_t shift = group - 1;
+  uint64_t low = ((uint64_t)(sub | (1u << k_hist_sub_bits))) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(Histogram *h, uint64_t val)
+{
+  h->counts[hist_bucket(val)]++;
+  h->total++;
+  h->sum += val;
+  if (val > h->max.get())
+  {
+    h->max.val.store(val, std::memory_order_relaxed);
+  }
+}
+
+void hist_merge(HistSum *dst, const Histogram *src)
+{
+  for (uint32_t i = 0; i < k_hist_buckets; ++i)
+  {
+    dst->counts[i] += src->counts[i].get();
+  }
+  dst->total += src->total.get();
+  dst->sum += src->sum.get();
+  dst->max = std::max(dst->max, src->max.get());
+}
+
+uint64_t hist_quantile(const HistSum *h, double q)
+{
+  if (h->total == 0)
+  {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(q * (double)h->total);
+  if (rank >= h->total)
+  {
+    rank = h->total - 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < k_hist_buckets; ++i)
+  {
+    seen += h->counts[i];
+    if (seen > rank)
+    {
+      return std::min(hist_bucket_max(i), h->max);
+    }
+  }
+  return h->max;
+}
@@ -0,0 +1,457 @@
+// Open addressing engine for the HMap API, built with -DHMAP_SWISS.
+//
+// Slots come in groups of 16 with one control byte each: the low 7 bits of
+// the hash when full, or k_empty / k_deleted. A probe compares the 16 bytes
+// of a group at once and only follows the pointers whose tag matches, so a
+// miss rarely touches a node. The rest of the hash picks the home group,
+// further groups are probed in triangular steps until one has an empty slot.
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <initializer_list>
+#include <utility>
+#include "hashtable.h"
+
+#ifdef HMAP_SWISS
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HMAP_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <xmmintrin.h>
+#define prefetch(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+static inline unsigned ctz(uint32_t v)
+{
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return (unsigned)i;
+}
+#else
+#define prefetch(p) __builtin_prefetch(p)
+static inline unsigned ctz(uint32_t v)
+{
+    return (unsigned)__builtin_ctz(v);
+}
+#endif
+
+const size_t k_group = 16;
+const uint8_t k_empty = 0x80;
+const uint8_t k_deleted = 0xFE;
+
+static inline uint8_t h_tag(uint64_t hcode)
+{
+    return hcode & 0x7F;
+}
+
+static inline size_t h_home(HTab *htab, uint64_t hcode)
+{
+    return (size_t)(hcode >> 7) & htab->gmask;
+}
+
+// bit i is set if byte i of the group equals tag
+static inline uint32_t g_match(const uint8_t *ctrl, uint8_t tag)
+{
+#ifdef HMAP_SSE2
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group; ++i)
+    {
+        bits |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return bits;
+#endif
+}
+
+// empty or deleted slots, the only control bytes with the top bit set
+static inline uint32_t g_free(const uint8_t *ctrl)
+{
+#ifdef HMAP_SSE2
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group; ++i)
+    {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+static inline size_t h_slots(HTab *htab)
+{
+    return htab->ctrl ? (htab->gmask + 1) * k_group : 0;
+}
+
+// n groups, n must be a power of 2
+static void h_init(HTab *htab, size_t n)
+{
+    assert(n > 0 && ((n - 1) & n) == 0);
+    htab->ctrl = (uint8_t *)malloc(n * k_group);
+    memset(htab->ctrl, k_empty, n * k_group);
+    htab->slots = (HNode **)malloc(n * k_group * sizeof(HNode *));
+    htab->gmask = n - 1;
+    htab->size = 0;
+    htab->deleted = 0;
+}
+
+static void h_free(HTab *htab)
+{
+    free(htab->ctrl);
+    free(htab->slots);
+    *htab = HTab{};
+}
+
+// the table always keeps a free slot, so this finds one
+static void h_insert(HTab *htab, HNode *node)
+{
+    size_t g = h_home(htab, node->hcode);
+    for (size_t i = 1;; g = (g + i++) & htab->gmask)
+    {
+        uint8_t *ctrl = &htab->ctrl[g * k_group];
+        if (uint32_t bits = g_free(ctrl))
+        {
+            size_t pos = g * k_group + ctz(bits);
+            if (htab->ctrl[pos] == k_deleted)
+            {
+                htab->deleted--;
+            }
+            htab->ctrl[pos] = h_tag(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+    }
+}
+
+// the slot index of the node matching key, or SIZE_MAX
+static size_t h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    if (!htab->ctrl)
+    {
+        return SIZE_MAX;
+    }
+
+    uint8_t tag = h_tag(key->hcode);
+    size_t g = h_home(htab, key->hcode);
+    for (size_t i = 1; i <= htab->gmask + 1; g = (g + i++) & htab->gmask)
+    {
+        const uint8_t *ctrl = &htab->ctrl[g * k_group];
+        for (uint32_t bits = g_match(ctrl, tag); bits; bits &= bits - 1)
+        {
+            size_t pos = g * k_group + ctz(bits);
+            HNode *node = htab->slots[pos];
+            if (node->hcode == key->hcode && eq(node, key))
+            {
+                return pos;
+            }
+        }
+        if (g_match(ctrl, k_empty))
+        {
+            break;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static HNode *h_detach(HTab *htab, size_t pos)
+{
+    HNode *node = htab->slots[pos];
+    // a probe stops at a group with an empty slot, so one more empty slot
+    // in such a group cannot cut a probe short; elsewhere leave a marker
+    const uint8_t *ctrl = &htab->ctrl[pos & ~(k_group - 1)];
+    if (g_match(ctrl, k_empty))
+    {
+        htab->ctrl[pos] = k_empty;
+    }
+    else
+    {
+        htab->ctrl[pos] = k_deleted;
+        htab->deleted++;
+    }
+    htab->size--;
+    return node;
+}
+
+const size_t k_resizing_work = 128; // constant work
+
+// move whole groups of ht2 to ht1, the moved slots become deleted markers
+// so the probes through them still reach the groups not yet moved
+static void hm_help_resizing(HMap *hmap, size_t nwork_max = k_resizing_work)
+{
+    size_t nwork = 0;
+    while (nwork < nwork_max && hmap->ht2.size > 0)
+    {
+        size_t base = hmap->resizing_pos * k_group;
+        for (size_t pos = base; pos < base + k_group; ++pos)
+        {
+            if (!(hmap->ht2.ctrl[pos] & 0x80))
+            {
+                h_insert(&hmap->ht1, hmap->ht2.slots[pos]);
+                hmap->ht2.ctrl[pos] = k_deleted;
+                hmap->ht2.size--;
+                nwork++;
+            }
+        }
+        hmap->resizing_pos++;
+    }
+
+    if (hmap->ht2.size == 0 && hmap->ht2.ctrl)
+    {
+        // done
+        h_free(&hmap->ht2);
+    }
+}
+
+// move the nodes to a new table of n groups, bigger, smaller or the same
+// size to clear the deleted markers
+static void hm_start_resizing(HMap *hmap, size_t n)
+{
+    assert(hmap->ht2.ctrl == NULL);
+    hmap->ht2 = hmap->ht1;
+    h_init(&hmap->ht1, n);
+    hmap->resizing_pos = 0;
+}
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        size_t pos = h_lookup(htab, key, eq);
+        if (pos != SIZE_MAX)
+        {
+            return htab->slots[pos];
+        }
+    }
+    return NULL;
+}
+
+void hm_insert(HMap *hmap, HNode *node)
+{
+    if (!hmap->ht1.ctrl)
+    {
+        h_init(&hmap->ht1, 1);
+    }
+    h_insert(&hmap->ht1, node);
+
+    // at most 7/8 of the slots used, counting the deleted markers
+    HTab *ht1 = &hmap->ht1;
+    if ((ht1->size + ht1->deleted) * 8 >= h_slots(ht1) * 7)
+    {
+        // a resize moves 128 nodes per call and so ends long before the
+        // new table fills up, but never run two at once
+        while (hmap->ht2.ctrl)
+        {
+            hm_help_resizing(hmap);
+        }
+        // grow if at least half of the slots are live, otherwise the
+        // deleted markers are what filled the table
+        size_t n = ht1->gmask + 1;
+        hm_start_resizing(hmap, ht1->size * 2 >= h_slots(ht1) ? n * 2 : n);
+    }
+    hm_help_resizing(hmap);
+}
+
+// shrink once under 1/8 of the slots are live, to a table at most half full
+static void hm_check_shrink(HMap *hmap)
+{
+    HTab *ht1 = &hmap->ht1;
+    if (hmap->ht2.ctrl || ht1->gmask == 0 || ht1->size * 8 >= h_slots(ht1))
+    {
+        return;
+    }
+    size_t n = 1;
+    while (n * k_group < ht1->size * 2)
+    {
+        n *= 2;
+    }
+    hm_start_resizing(hmap, n);
+}
+
+HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        size_t pos = h_lookup(htab, key, eq);
+        if (pos != SIZE_MAX)
+        {
+            HNode *node = h_detach(htab, pos);
+            hm_check_shrink(hmap);
+            return node;
+        }
+    }
+    return NULL;
+}
+
+bool hm_rehash(HMap *hmap, size_t nwork)
+{
+    hm_help_resizing(hmap, nwork);
+    return hmap->ht2.ctrl != NULL;
+}
+
+size_t hm_size(HMap *hmap)
+{
+    return hmap->ht1.size + hmap->ht2.size;
+}
+
+void hm_prefetch_slot(HMap *hmap, uint64_t hcode)
+{
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        if (htab->ctrl)
+        {
+            prefetch(&htab->ctrl[h_home(htab, hcode) * k_group]);
+        }
+    }
+}
+
+// the control bytes should be in cache by now, fetch the first candidate
+void hm_prefetch_chain(HMap *hmap, uint64_t hcode)
+{
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        if (!htab->ctrl)
+        {
+            continue;
+        }
+        size_t base = h_home(htab, hcode) * k_group;
+        if (uint32_t bits = g_match(&htab->ctrl[base], h_tag(hcode)))
+        {
+            prefetch(&htab->slots[base + ctz(bits)]);
+        }
+    }
+}
+
+void hm_destroy(HMap *hmap)
+{
+    h_free(&hmap->ht1);
+    h_free(&hmap->ht2);
+    *hmap = HMap{};
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg)
+{
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        for (size_t pos = 0; pos < h_slots(htab); ++pos)
+        {
+            if (!(htab->ctrl[pos] & 0x80))
+            {
+                f(htab->slots[pos], arg);
+            }
+        }
+    }
+}
+
+void hm_stats(HMap *hmap, HMapStats *stats)
+{
+    stats->size = hm_size(hmap);
+    stats->buckets = h_slots(&hmap->ht1);
+    stats->rehash_buckets = h_slots(&hmap->ht2);
+    stats->rehash_pos = hmap->ht2.ctrl ? hmap->resizing_pos * k_group : 0;
+    // a control byte and a pointer per slot
+    stats->bytes = (stats->buckets + stats->rehash_buckets) * (1 + sizeof(HNode *));
+}
+
+const size_t k_sample_steps = 10; // slots per wanted node
+
+size_t hm_sample(HMap *hmap, size_t pos, HNode **out, size_t n)
+{
+    size_t found = 0;
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2})
+    {
+        size_t mask = h_slots(htab) - 1;
+        for (size_t i = 0; htab->size && i < n * k_sample_steps && found < n; ++i)
+        {
+            size_t slot = (pos + i) & mask;
+            if (!(htab->ctrl[slot] & 0x80))
+            {
+                out[found++] = htab->slots[slot];
+            }
+        }
+    }
+    return found;
+}
+
+static size_t rev_bits(size_t v)
+{
+    size_t r = 0;
+    for (size_t i = 0; i < sizeof(v) * 8; ++i)
+    {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+// add 1 to the bits of v above mask, counting from the top bit down
+static size_t rev_next(size_t v, size_t mask)
+{
+    v |= ~mask;
+    return rev_bits(rev_bits(v) + 1);
+}
+
+// The scan buckets are the home groups. The nodes of home group g sit on
+// its probe sequence up to the first group with an empty slot, where a
+// lookup would stop too, so walk that far and keep the ones homed at g.
+static void h_scan_bucket(HTab *htab, size_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    size_t home = cursor & htab->gmask;
+    size_t g = home;
+    for (size_t i = 1; i <= htab->gmask + 1; g = (g + i++) & htab->gmask)
+    {
+        const uint8_t *ctrl = &htab->ctrl[g * k_group];
+        for (size_t j = 0; j < k_group; ++j)
+        {
+            if (ctrl[j] & 0x80)
+            {
+                continue;
+            }
+            HNode *node = htab->slots[g * k_group + j];
+            if (h_home(htab, node->hcode) == home)
+            {
+                f(node, arg);
+            }
+        }
+        if (g_match(ctrl, k_empty))
+        {
+            break;
+        }
+    }
+}
+
+size_t hm_scan(HMap *hmap, size_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    if (!hmap->ht1.ctrl)
+    {
+        return 0;
+    }
+    if (!hmap->ht2.ctrl)
+    {
+        h_scan_bucket(&hmap->ht1, cursor, f, arg);
+        return rev_next(cursor, hmap->ht1.gmask);
+    }
+
+    // while resizing: the bucket of the smaller table, then every bucket of
+    // the larger one whose nodes would come from it
+    HTab *small = &hmap->ht1, *large = &hmap->ht2;
+    if (small->gmask > large->gmask)
+    {
+        std::swap(small, large);
+    }
+    h_scan_bucket(small, cursor, f, arg);
+    do
+    {
+        h_scan_bucket(large, cursor, f, arg);
+        cursor = rev_next(cursor, large->gmask);
+    } while (cursor & (small->gmask ^ large->gmask));
+    return cursor;
+}
+
+#endif // HMAP_SWISS
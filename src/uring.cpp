@@ -0,0 +1,264 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "protocol.h"
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+// user_data of the driver's own requests
+const uint64_t k_internal = ~(uint64_t)0;
+
+// The opcodes the loop uses. IORING_OP_SOCKET is not used, but it came in
+// the same kernel (5.19) as multishot accept, which has no probe or
+// feature bit of its own.
+static const uint8_t k_needed_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+    IORING_OP_PROVIDE_BUFFERS, IORING_OP_SOCKET,
+};
+
+static bool probe_ops(int ring_fd)
+{
+  const unsigned nops = 256;
+  io_uring_probe *probe = (io_uring_probe *)calloc(
+      1, sizeof(io_uring_probe) + nops * sizeof(io_uring_probe_op));
+  if (!probe)
+  {
+    return false;
+  }
+  bool ok = sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, nops) >= 0;
+  for (uint8_t op : k_needed_ops)
+  {
+    ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+IoUring::IoUring() {}
+
+IoUring::~IoUring()
+{
+  if (bufs)
+  {
+    free(bufs);
+  }
+  if (sqes)
+  {
+    munmap(sqes, sqes_len);
+  }
+  if (cq_ptr && cq_ptr != sq_ptr)
+  {
+    munmap(cq_ptr, cq_len);
+  }
+  if (sq_ptr)
+  {
+    munmap(sq_ptr, sq_len);
+  }
+  if (ring_fd >= 0)
+  {
+    close(ring_fd);
+  }
+}
+
+bool IoUring::init(unsigned entries, unsigned nbufs, unsigned bsize)
+{
+  io_uring_params p = {};
+  // multishot accept can post many completions per submission
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4;
+  ring_fd = sys_io_uring_setup(entries, &p);
+  if (ring_fd < 0)
+  {
+    return false;
+  }
+  // buf_recycle() relies on IOSQE_CQE_SKIP_SUCCESS (5.17)
+  if (!(p.features & IORING_FEAT_CQE_SKIP) || !probe_ops(ring_fd))
+  {
+    msg("io_uring: the kernel lacks multishot accept or CQE skipping");
+    return false;
+  }
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  ext_arg = p.features & IORING_FEAT_EXT_ARG;
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap)
+  {
+    sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+  }
+  sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED)
+  {
+    sq_ptr = nullptr;
+    return false;
+  }
+  cq_ptr = sq_ptr;
+  if (!single_mmap)
+  {
+    cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED)
+    {
+      cq_ptr = nullptr;
+      return false;
+    }
+  }
+  sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+  sqes = (io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+  {
+    sqes = nullptr;
+    return false;
+  }
+
+  char *sq = (char *)sq_ptr;
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  // the index array is the identity, SQEs are consumed in order
+  unsigned *array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries; ++i)
+  {
+    array[i] = i;
+  }
+  sqe_tail = *sq_tail;
+
+  char *cq = (char *)cq_ptr;
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // hand the whole buffer pool to the kernel
+  buf_size = bsize;
+  bufs = (uint8_t *)malloc((size_t)nbufs * bsize);
+  if (!bufs)
+  {
+    return false;
+  }
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = (int)nbufs;
+  sqe->addr = (uint64_t)(uintptr_t)bufs;
+  sqe->len = bsize;
+  sqe->off = 0; // first buffer ID
+  sqe->buf_group = 0;
+  sqe->user_data = k_internal;
+  if (submit_and_wait(1) < 0)
+  {
+    return false;
+  }
+  io_uring_cqe *cqe = &cqes[*cq_head & cq_mask];
+  int res = cqe->res;
+  cqe_seen();
+  return res >= 0;
+}
+
+io_uring_sqe *IoUring::get_sqe()
+{
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sqe_tail - head >= sq_entries)
+  {
+    return NULL;
+  }
+  io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+  sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int IoUring::submit_and_wait(unsigned wait_nr, int timeout_ms)
+{
+  unsigned to_submit = sqe_tail - *sq_tail;
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  __kernel_timespec ts = {};
+  io_uring_getevents_arg arg = {};
+  if (wait_nr && timeout_ms >= 0 && ext_arg)
+  {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  int rv = 0;
+  do
+  {
+    rv = (flags & IORING_ENTER_EXT_ARG)
+             ? sys_io_uring_enter(ring_fd, to_submit, wait_nr, flags, &arg, sizeof(arg))
+             : sys_io_uring_enter(ring_fd, to_submit, wait_nr, flags, NULL, 0);
+    g_io_stats.syscalls++;
+  } while (rv < 0 && errno == EINTR);
+  return rv;
+}
+
+io_uring_cqe *IoUring::peek_cqe()
+{
+  while (true)
+  {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    {
+      return NULL;
+    }
+    io_uring_cqe *cqe = &cqes[head & cq_mask];
+    if (cqe->user_data != k_internal)
+    {
+      return cqe;
+    }
+    if (cqe->res < 0)
+    {
+      msg("io_uring: failed to recycle a buffer");
+    }
+    cqe_seen();
+  }
+}
+
+void IoUring::cqe_seen()
+{
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void IoUring::buf_recycle(uint16_t bid)
+{
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe)
+  {
+    submit_and_wait(0);
+    sqe = get_sqe();
+  }
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = 1;
+  sqe->addr = (uint64_t)(uintptr_t)buf_ptr(bid);
+  sqe->len = buf_size;
+  sqe->off = bid;
+  sqe->buf_group = 0;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = k_internal;
+}
+
+#endif // HAVE_IO_URING
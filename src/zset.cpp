@@ -5,7 +5,7 @@
 #include "zset.h"
 #include "common.h"
 
-static ZNode *znode_new(const std::string &name, double score)
+static ZNode *znode_new(std::string_view name, double score)
 {
   ZNode *node = new ZNode();
 
@@ -16,12 +16,21 @@ static ZNode *znode_new(const std::string &name, double score)
 
   avl_init(&node->tree);
   node->hmap.next = nullptr;
-  node->hmap.hcode = str_hash(reinterpret_cast<const uint8_t *>(name.c_str()), name.size());
+  node->hmap.hcode = str_hash(reinterpret_cast<const uint8_t *>(name.data()), name.size());
   node->score = score;
   node->name = name;
   return node;
 }
 
+static size_t znode_mem(const ZNode *node)
+{
+  // the name has a buffer of its own once it is too long to fit inline
+  const char *data = node->name.data();
+  bool inline_name = data >= (const char *)&node->name && data < (const char *)(&node->name + 1);
+  size_t name_mem = inline_name ? 0 : node->name.capacity() + 1;
+  return sizeof(ZNode) + name_mem;
+}
+
 static uint32_t min_size(std::size_t lhs, std::size_t rhs)
 {
   return lhs < rhs ? lhs : rhs;
@@ -29,14 +38,14 @@ static uint32_t min_size(std::size_t lhs, std::size_t rhs)
 
 // compare by the (score, name) tuple
 static bool zless(
-    AVLNode *lhs, double score, const std::string &name)
+    AVLNode *lhs, double score, std::string_view name)
 {
   ZNode *zl = container_of(lhs, ZNode, tree);
   if (zl->score != score)
   {
     return zl->score < score;
   }
-  int rv = memcmp(zl->name.c_str(), name.c_str(), min_size(zl->name.size(), name.size()));
+  int rv = memcmp(zl->name.data(), name.data(), min_size(zl->name.size(), name.size()));
   if (rv != 0)
   {
     return rv < 0;
@@ -79,7 +88,7 @@ static void zset_update(ZSet *zset, ZNode *node, double score)
 }
 
 // add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_add(ZSet *zset, const std::string &name, double score)
+bool zset_add(ZSet *zset, std::string_view name, double score)
 {
   ZNode *node = zset_lookup(zset, name);
   if (node)
@@ -92,6 +101,7 @@ bool zset_add(ZSet *zset, const std::string &name, double score)
     node = znode_new(name, score);
     hm_insert(&zset->hmap, &node->hmap);
     tree_add(zset, node);
+    zset->mem += znode_mem(node);
     return true;
   }
 }
@@ -104,11 +114,11 @@ static bool hcmp(HNode *node, HNode *key)
   {
     return false;
   }
-  return 0 == memcmp(znode->name.c_str(), hkey->name.c_str(), znode->name.size());
+  return 0 == memcmp(znode->name.data(), hkey->name.data(), znode->name.size());
 }
 
 // lookup by name
-ZNode *zset_lookup(ZSet *zset, const std::string &name)
+ZNode *zset_lookup(ZSet *zset, std::string_view name)
 {
   if (!zset->tree)
   {
@@ -116,14 +126,14 @@ ZNode *zset_lookup(ZSet *zset, const std::string &name)
   }
 
   HKey key;
-  key.node.hcode = str_hash((uint8_t *)name.c_str(), name.size());
+  key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
   key.name = name;
   HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
   return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
 // deletion by name
-ZNode *zset_pop(ZSet *zset, const std::string &name)
+ZNode *zset_pop(ZSet *zset, std::string_view name)
 {
   if (!zset->tree)
   {
@@ -131,7 +141,7 @@ ZNode *zset_pop(ZSet *zset, const std::string &name)
   }
 
   HKey key;
-  key.node.hcode = str_hash((uint8_t *)name.c_str(), name.size());
+  key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
   key.name = name;
   HNode *found = hm_pop(&zset->hmap, &key.node, &hcmp);
   if (!found)
@@ -141,11 +151,12 @@ ZNode *zset_pop(ZSet *zset, const std::string &name)
 
   ZNode *node = container_of(found, ZNode, hmap);
   zset->tree = avl_del(&node->tree);
+  zset->mem -= znode_mem(node);
   return node;
 }
 
 // find the (score, name) tuple that is greater or equal to the argument.
-ZNode *zset_query(ZSet *zset, double score, const std::string &name)
+ZNode *zset_query(ZSet *zset, double score, std::string_view name)
 {
   AVLNode *found = NULL;
   AVLNode *cur = zset->tree;
@@ -187,6 +198,13 @@ static void tree_dispose(AVLNode *node)
   znode_del(container_of(node, ZNode, tree));
 }
 
+size_t zset_mem(ZSet *zset)
+{
+  HMapStats stats;
+  hm_stats(&zset->hmap, &stats);
+  return sizeof(ZSet) + zset->mem + stats.bytes;
+}
+
 // destroy the zset
 void zset_dispose(ZSet *zset)
 {